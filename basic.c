@@ -1,128 +1,514 @@
 #include "basic.h"
 #include <stdlib.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //===================================================CONSTANTS====================================================
 #define WAVETABLE_SIZE 128
 #define WAVETABLE_MASK 0x7F
+#define WAVETABLE_BITS 7 // log2(WAVETABLE_SIZE), the top bits of the phase accumulator index the wavetable
 
 #define DEFAULT_TEMPO 100
 #define DEFAULT_OCTAVE 4
 
+#define FRAME_RATE 60   // UPDATE holds the logic clock to this many frames per second
+#define FRAME_SPIN_MS 2 // Sleep until this close to the next frame, then spin the rest of the way
+#define FRAME_MAX_LAG 4 // Frames UPDATE may fall behind before it stops catching up and starts over
+
+#define TIMER_WHEEL_SIZE 256 // Must be a power of 2
+#define TIMER_ENTRY_BITS 16  // A TIMER_SET id is the entry in these low bits, and the entry's generation above
+#define TIMER_GEN_MASK ((1 << (31 - TIMER_ENTRY_BITS)) - 1)
+
+#define PCG_MULTIPLIER 6364136223846793005ull // The LCG underneath every RNG
+
+#define WORLD_TILE_BITS 4                   // The WORLD is stored in square tiles of WORLD_TILE cells a side
+#define WORLD_TILE (1 << WORLD_TILE_BITS) //
+#define WORLD_TILE_MASK (WORLD_TILE - 1)  //
+
+#define KEY_WORDS ((SDL_NUM_SCANCODES + 31) / 32) // U32s in a bitset of every scancode
+
+#define PROFILE_FRAMES 256 // PROFILE_GET's stats cover this many of the latest frames
+#define PROFILE_REFRESH 30 // Frames between updates of the PROFILE_OVERLAY text
+
+#define SONG_CACHE_SIZE 16
+#define AUDIO_QUEUE_SIZE 64 // Must be a power of 2
+#define AUDIO_VOICES 8       // Voice 0 plays PLAY's music, the rest play SOUND effects
+#define AUDIO_BLOCK 256      // Voices are mixed in blocks of this many samples
+#define AUDIO_LOG_SIZE 64    // Must be a power of 2
+#define AUDIO_LATE 75        // A buffer is late if filling it takes this percent of the time it plays for
+
 enum { MUSIC_LEGATO, MUSIC_NORMAL, MUSIC_STACCATO };
+enum { AUDIO_PLAY, AUDIO_SOUND };
+enum { AUDIO_LOG_COMMAND, AUDIO_LOG_LATE }; // Types of AUDIO_LOG
+enum { INPUT_KEYDOWN, INPUT_KEYUP, INPUT_SEED, INPUT_END }; // Types of INPUT_EVENT
+
+#define INPUT_MAGIC "BASICREC" // Input logs start with this and INPUT_VERSION, then hold an INPUT_EVENT every
+#define INPUT_VERSION 1        // INPUT_EVENT_SIZE bytes. Everything is little endian.
+#define INPUT_EVENT_SIZE 12    //
+
+//=====================================================TYPES======================================================
+typedef struct { // The state PLAY carries over from one song to the next, like QBasic
+  I octave;      // Octave of next note, 0 - 6
+  I tempo;       // Tempo in samples
+  I tempo_div;   // Actual note length is tempo / tempo_div, for quater/half/etc notes
+  I flow;        // Space between notes
+  I background;  // Does PLAY return right away (MB) or wait for the music to finish (MF)?
+} SONG_STATE;    //
+
+typedef struct { // A compiled PLAY command, either a note or a rest if freq is 0
+  I freq;        // Frequency in Hz
+  I samples;     // Duration in samples
+} SONG_EVENT;    //
+
+typedef struct {      // A PLAY string compiled into a list of events
+  C *text;            // Copy of the PLAY string, or NULL if this cache slot is free
+  U32 hash;           // Hash of text
+  U32 used;           // When this was last PLAYed, for evicting the least recently used song
+  SDL_bool queued;    // Has this been sent to audio_callback? It can't be evicted until audio_callback has
+  SDL_bool replaced;  // taken a later PLAY that replaced it, until then the music voice may be reading it.
+  U32 sent;           // Queue positions of this song's PLAY and the PLAY that replaced it
+  U32 replaced_by;    //
+  SONG_STATE start;   // Song state before and after the song. The same string compiles differently if it
+  SONG_STATE end;     // starts in a different state.
+  SONG_EVENT *events; //
+  I count;            //
+} SONG;               //
+
+typedef struct {            // A command from the main thread to audio_callback
+  I type;                   // AUDIO_PLAY or AUDIO_SOUND
+  const SONG_EVENT *events; // AUDIO_PLAY song
+  I count;                  //
+  SONG_EVENT sound;         // AUDIO_SOUND note
+} AUDIO_COMMAND;            //
+
+typedef struct {            // A voice mixed by audio_callback
+  const SONG_EVENT *events; // The voice's events, NULL when the voice is free
+  I count;                  //
+  I event;                  // Index of the next event
+  SONG_EVENT sound;         // Effect voices play this SOUND note
+  I note;                   // Frequency of current note in Hz
+  I duration;               // Number of samples remaining in current note
+  U32 inc;                  // Phase increment per sample of the current note
+  U32 phase;                // Phase accumulator, a 0.32 fixed point position in the wavetable
+  U32 pos;                  // Queue position of the command that started the voice
+} VOICE;                    //
+
+typedef struct { // A message from audio_callback, logged by the main thread in UPDATE
+  I type;        // AUDIO_LOG_ type
+  I a;           // The message's numbers
+  I b;           //
+} AUDIO_LOG;     //
+
+typedef struct {  // Running totals kept by audio_callback for AUDIO_STATS
+  U64 callbacks;  // Buffers filled
+  U64 ticks;      // Performance counter ticks spent filling them
+  U64 max_ticks;  // The slowest buffer
+  U64 late;       // Buffers that took AUDIO_LATE percent of their time or more
+} AUDIO_COUNTERS; //
+
+typedef struct { // Input recorded by RECORD and fed back by REPLAY
+  U32 frame;      // Value of timer when the input happened
+  U8 type;        // INPUT_ type
+  U8 repeat;      // Is this key event an OS repeat?
+  U16 scan;       // Scancode of key events
+  I32 value;      // Keycode of key events, or the seed of INPUT_SEED
+} INPUT_EVENT;    //
+
+typedef struct {  // A periodic callback set by TIMER_SET
+  V (*func)(V);   // The callback, NULL once the timer is deleted
+  I period;       // Frames between calls
+  U32 due;        // Value of timer at the next call
+  I next;         // Next timer in the same timer_wheel slot or the free list, 0 at the end
+  I gen;          // Bumped every time the entry is reused, so ids of the timers it held before don't match it
+} TIMER_ENTRY;    //
 
 //====================================================STATICS=====================================================
 static SDL_Window *window;     // SDL stuff
 static SDL_Renderer *renderer; //
 static SDL_bool window_closed; // Has the window been closed?
 
+static I headless;                        // HEADLESS_ mode, see basic.h
+static SDL_Surface *headless_framebuffer; // The software renderer draws here when headless
+
 static SDL_Texture *fontTex;      // Textures for rendering the screen
 static SDL_Texture *screenTex;    //
-static SDL_Texture *bigScreenTex; //
-
-static CELL screen[SCREEN_HEIGHT][SCREEN_WIDTH];                // The screen itself. The verts are for
-static SDL_Vertex colorVerts[SCREEN_WIDTH * SCREEN_HEIGHT * 6]; // SDL_RenderGeometry, which is much faster than
-static SDL_Vertex glyphVerts[SCREEN_WIDTH * SCREEN_HEIGHT * 6]; // trying to use SDL_RenderCopy
+static SDL_Texture *bigScreenTex; // SCALE_SMOOTH scales the screen up to this first, NULL in the other modes
+static SDL_Texture *streamTex;    // RENDER_SOFTWARE uploads the framebuffer here
+
+static I render_mode; // RENDER_ mode, see basic.h
+static I scale_mode;  // SCALE_ mode, see basic.h
+
+static I screen_width = SCREEN_WIDTH;   // The text mode, set by WIDTH. Every buffer below that is sized by the
+static I screen_height = SCREEN_HEIGHT; // mode is carved out of the arena, which is reallocated for each mode.
+static U8 *arena;                       //
+
+// The software renderer rasterizes the screen into this framebuffer in SDL_PIXELFORMAT_RGBA32. Each glyph is
+// decoded from the font into a 1-bpp mask, one U16 per row with bit 0 as the leftmost pixel, and the expanded
+// masks turn a nibble of that into a 4 pixel select mask for blending fg and bg.
+static U32 *framebuffer; // screen_height * FONT_HEIGHT rows of screen_width * FONT_WIDTH pixels
+static U16 glyph_masks[256][FONT_HEIGHT];
+static U32 glyph_expand[16][4];
+static U32 palette_rgba[16];
+
+static CELL *pages;     // The screen pages, each screen_height rows of screen_width cells. SET draws to the
+static CELL *active;    // active page, and the visible page is the screen itself.
+static CELL *screen;    //
+static I active_page;   //
+static I visible_page;  //
+
+static U8 *page_rows;   // Where each row of each page is kept. Scrolling a page only rotates its rows, the cells
+static U8 *active_rows; // and the verts of the visible page stay where they are and the rows are put back in
+static U8 *screen_rows; // order when the screen is presented.
+
+static I view_top;    // The VIEW_PRINT region, PRINT scrolls these rows when it runs off the bottom
+static I view_bottom; //
+
+static SDL_Vertex *colorVerts; // The verts mirror the visible page. They are for SDL_RenderGeometry, which is
+static SDL_Vertex *glyphVerts; // much faster than trying to use SDL_RenderCopy. Each cell is a quad of 4 verts
+static I *quadIndices;         // drawn as 2 indexed triangles.
+static SDL_FPoint glyphUVs[256][4]; // Texture coordinates of each glyph's quad in fontTex, in vert order
+
+static I *dirty_x0;            // The span of cells [x0, x1) on each row that have been SET since they were last
+static I *dirty_x1;            // rendered into screenTex. A row is clean when x0 >= x1.
+static SDL_bool dirty;         // Is any row dirty?
+static SDL_bool needs_present; // Does the window need to be presented even if the screen is clean?
+static I redrawn;              // Number of cells rendered by the last UPDATE
 
 static I cursor_x;  // Cursor position. These are 0-based indices into the screen array, be aware that the
 static I cursor_y;  // user uses 1-based screen locations in functions such as LOCATE.
 static I cursor_fg; // Cursor color, this is the color drawn to cells when a PRINT occurs.
 static I cursor_bg;
 
-static I timer;
-// static Uint64 last_frame;
-
-static U8 keys[SDL_NUM_SCANCODES];      // The keyboard state this frame
-static U8 last_keys[SDL_NUM_SCANCODES]; // and last frame
+static SDL_bool cursor_below_view; // Did printing take the cursor off the bottom of the VIEW_PRINT region? The
+                                   // region scrolls up when the next text is printed there.
+
+static CELL *world;          // The WORLD's cells, a tile after another in rows of world_tiles tiles. The cells of
+static I world_tiles;        // a tile are in rows too, so a neighbourhood of the world fits in a few cache lines
+static I world_w;            // whichever way it's walked.
+static I world_h;            //
+static CELL world_fill;      // Shown where the camera looks outside the world
+static I camera_x;           // The world cell CAMERA shows at the top left of the screen
+static I camera_y;           //
+static I camera_page = -1;   // The page CAMERA last drew, -1 once anything else has scrolled or cleared it
+static SDL_bool camera_rows; // Does camera_page show only the WORLD, so CAMERA can rotate its rows into place?
+                             // Drawing over the WORLD clears this, though WSET still shows on the page.
+
+static I timer;                         // Frames since START
+static SDL_bool timers_on;              // Are timer callbacks called? Timers still run when they're not.
+static TIMER_ENTRY *timers;             // Every timer, entry 0 is never used so that 0 can mean none
+static I timers_size;                   // Number of entries in timers
+static I timers_free;                   // First unused entry
+static I timer_wheel[TIMER_WHEEL_SIZE]; // Timers due on frames that are equal modulo TIMER_WHEEL_SIZE
+
+static I profile_flags;                                    // PROFILE_ flags, 0 when not profiling
+static U64 profile_last;                                   // Performance counter at the end of the last phase
+static U64 profile_ticks[PROFILE_PHASES];                  // Ticks spent in each phase so far this frame
+static U32 profile_sets;                                   // SET calls so far this frame, always counted
+static float profile_ring[PROFILE_FRAMES][PROFILE_PHASES]; // The latest frames, in ms or SET calls
+static I profile_frames;                                   // Frames profiled since PROFILE
+static float (*profile_log)[PROFILE_PHASES];               // Every frame profiled since PROFILE, for the CSV
+static I profile_log_size;                                 // Number of frames profile_log has room for
+static C *profile_csv;                                     // Path END writes profile_log to, NULL for none
+static CELL *profile_row;                                   // The PROFILE_OVERLAY, drawn over the bottom row
+static I profile_row_y = -1;                               // Where the bottom row was kept when last drawn
+static const C *profile_names[PROFILE_PHASES] = {"program", "keyboard", "events", "timers", "render",
+                                                 "copy",    "present",  "wait",   "sets"};
+
+static U64 frame_epoch; // Performance counter when the logic clock started, 0 until the first UPDATE
+static U64 frame_count; // Frames since frame_epoch
+
+static U32 keys_down[KEY_WORDS];             // Bitsets by scancode of the keys held down, the keys pressed this
+static U32 keys_just[KEY_WORDS];             // frame or repeated by typematic, and the keys released this frame
+static U32 keys_up[KEY_WORDS];               //
+static SCAN held_keys[SDL_NUM_SCANCODES];    // The keys held down, with how many frames each has been held for
+static U8 held_frames[SDL_NUM_SCANCODES];    // typematic. Held frames are indexed by scancode.
+static I held_count;                         //
 
 static KEY key_buffer[1024]; // A circular buffer of all the keys pressed by the user
 static Z key_buffer_start;   //
 static Z key_buffer_end;     //
 
+static RNG random_rng; // The generator behind RANDOM
+
+static SDL_RWops *record_file;     // Input is written here while recording
+static INPUT_EVENT *replay_events; // The input being replayed, NULL when not replaying. Key events and seeds are
+static I replay_count;             // read in step with UPDATE and RANDOMIZE respectively.
+static I replay_key;               //
+static I replay_seed;              //
+
 static const C font_bmp[];    // The font BMP. See bottom of file
 static const Z font_bmp_size; //
 
 static SDL_AudioSpec audio_spec; // Sound device properties
 static I audio_device;           // Audio device ID
-
-static const C *song = "";   // The current song
-static I song_octave;        // Octave of next note, 0 - 6
-static I song_tempo;         // Tempo in samples
-static I song_tempo_div;     // Actual note length is tempo / tempo_div, for quater/half/etc notes
-static I song_flow;          // Space between notes
-static I song_note;          // Frequency of current note in Hz
-static I song_note_duration; // Number of samples remaining in current note
-static D song_sample;        // Current sample in the wavetable
+static SDL_bool audio_offline;   // Is audio_callback driven by AUDIO_RENDER instead of a device?
+
+static SONG song_cache[SONG_CACHE_SIZE]; // Compiled songs. PLAY only compiles strings it hasn't seen before.
+static U32 song_clock;                  // Incremented on every PLAY, for the cache's used times
+static SONG_STATE song_state;           // Song state at the end of the last PLAY
+static SONG *song_last;                 // The last song PLAYed
+static SONG_EVENT *song_scratch;        // Scratch space for compiling songs
+static I song_scratch_size;             //
+
+// PLAY and SOUND send commands to audio_callback through a single-producer, single-consumer ring. Only the main
+// thread writes the head and only the audio thread writes the tail, so neither side ever waits on the other.
+static AUDIO_COMMAND audio_queue[AUDIO_QUEUE_SIZE];
+static SDL_atomic_t audio_queue_head;
+static SDL_atomic_t audio_queue_tail;
+static SDL_atomic_t audio_music_done; // One past the queue position of the last PLAY that finished playing
+
+static VOICE voices[AUDIO_VOICES]; // Only touched by audio_callback
+
+// audio_callback can't log, that may block on a lock or on I/O. It sends messages back through a ring like
+// audio_queue the other way round, and UPDATE logs them. Its counters are published with a sequence number that is
+// odd while they are being written, AUDIO_STATS copies them again if the number was odd or changed meanwhile.
+static AUDIO_LOG audio_log[AUDIO_LOG_SIZE];
+static SDL_atomic_t audio_log_head;
+static SDL_atomic_t audio_log_tail;
+static SDL_atomic_t audio_log_dropped; // Messages lost to a full ring
+static AUDIO_COUNTERS audio_counters;  // Only written by audio_callback
+static SDL_atomic_t audio_counters_seq;
 
 // See DATA section for values
 static const I16 wavetable[WAVETABLE_SIZE]; // The PC speaker wavetable
+static I32 wavetable_step[WAVETABLE_SIZE];  // Difference between each wavetable sample and the next, for lerping
 static const SDL_Color palette[16];         // The VGA color palette
-static const I letter_to_note[256];         // Convert letter to a note
+static const I letter_to_note[256];         // Convert letter to a note, an index into a row of note_frequency
 static const I note_frequency[8][12];       // Frequency of each note in each octave
 
 //================================================bpm_to_samples==================================================
 I bpm_to_samples(I bpm) { return (I)(1 / ((D)bpm / 60) * 4 * audio_spec.freq); }
 
-//================================================audio_callback==================================================
-static void audio_callback(void *, U8 *stream_, I len) {
-  I16 *stream = (I16 *)stream_;
-  len /= 2;
+//====================================================page_at=====================================================
+// The cells of page p
+static inline CELL *page_at(I p) { return &pages[(Z)p * screen_width * screen_height]; }
 
-  I tries = 0; // Prevent accidental infinite loop
-  for (I sample = 0; tries < 1000 && sample < len; tries++) {
-    // Play a note if we have one to play
-    if (song_note_duration != 0) {
-      // If the note is 0 then this is a rest
-      if (song_note == 0) {
-        I d = SDL_min(song_note_duration, len - sample);
-        SDL_memset(&stream[sample], 0, d * 2);
-        song_note_duration -= d;
-        sample += d;
-      } else {
-        D inc = WAVETABLE_SIZE / ((D)audio_spec.freq / song_note);
-        for (; sample < len && song_note_duration > 0; sample++, song_note_duration--) {
-          D t = song_sample - (I)song_sample;
-          D v = (D)wavetable[(I)song_sample & WAVETABLE_MASK] * (1.0 - t) + //
-                (D)wavetable[((I)song_sample + 1) & WAVETABLE_MASK] * t;
-          stream[sample] = (I16)v;
-          song_sample += inc;
-          if (song_sample > WAVETABLE_SIZE)
-            song_sample -= WAVETABLE_SIZE;
-        }
-      }
+//====================================================rows_at=====================================================
+// Where each row of page p is kept
+static inline U8 *rows_at(I p) { return &page_rows[p * screen_height]; }
+
+//====================================================row_at======================================================
+// Row y of page as it's kept, look it up in the page's rows first to find a row as it's shown
+static inline CELL *row_at(CELL *page, I y) { return &page[y * screen_width]; }
+
+//==================================================mark_dirty====================================================
+static V mark_dirty(I y, I x0, I x1) {
+  dirty_x0[y] = SDL_min(dirty_x0[y], x0);
+  dirty_x1[y] = SDL_max(dirty_x1[y], x1);
+  dirty = SDL_TRUE;
+}
+
+//==================================================mark_clean====================================================
+static V mark_clean(I y) {
+  dirty_x0[y] = screen_width;
+  dirty_x1[y] = 0;
+}
+
+//===================================================blit_row=====================================================
+// Blit one row of a glyph, choosing fg where the mask is set and bg where it isn't
+static inline V blit_row(U32 *dst, U32 bits, U32 fg, U32 bg) {
+  I px = 0;
+#ifdef __SSE2__
+  const __m128i vbg = _mm_set1_epi32((I)bg);
+  const __m128i vdiff = _mm_set1_epi32((I)(fg ^ bg));
+  for (; px + 4 <= FONT_WIDTH; px += 4, bits >>= 4) {
+    __m128i m = _mm_loadu_si128((const __m128i *)glyph_expand[bits & 0xF]);
+    _mm_storeu_si128((__m128i *)&dst[px], _mm_xor_si128(vbg, _mm_and_si128(vdiff, m)));
+  }
+#endif
+  for (; px < FONT_WIDTH; px++, bits >>= 1)
+    dst[px] = bg ^ ((fg ^ bg) & -(bits & 1));
+}
+
+//================================================render_geometry=================================================
+// Render the dirty spans into screenTex. A run of consecutive dirty rows is drawn as one span, the clean cells
+// caught in between are just redrawn unchanged. This is far cheaper than a draw call per row.
+static I render_geometry() {
+  I cells = 0;
+
+  SDL_SetRenderTarget(renderer, screenTex);
+  for (I y = 0; y < screen_height; y++) {
+    if (dirty_x0[y] >= dirty_x1[y])
       continue;
+
+    I start = y * screen_width + dirty_x0[y];
+    while (y + 1 < screen_height && dirty_x0[y + 1] < dirty_x1[y + 1])
+      mark_clean(y++);
+    I end = y * screen_width + dirty_x1[y];
+    mark_clean(y);
+
+    // The indices are relative to the first vertex passed, so the same index buffer works for any span
+    const I n = end - start;
+    SDL_RenderGeometry(renderer, NULL, colorVerts + start * 4, n * 4, quadIndices, n * 6);
+    SDL_RenderGeometry(renderer, fontTex, glyphVerts + start * 4, n * 4, quadIndices, n * 6);
+    cells += end - start;
+  }
+
+  return cells;
+}
+
+//================================================render_software=================================================
+// Rasterize the dirty spans into the framebuffer, then upload the band of rows that changed with one call
+static I render_software() {
+  I cells = 0;
+  const I pitch = screen_width * FONT_WIDTH;
+  I y0 = screen_height, y1 = 0;
+
+  for (I y = 0; y < screen_height; y++) {
+    if (dirty_x0[y] >= dirty_x1[y])
+      continue;
+
+    const SDL_bool overlay = (profile_flags & PROFILE_OVERLAY_BIT) && y == profile_row_y;
+    const CELL *row = overlay ? profile_row : row_at(screen, y);
+    for (I x = dirty_x0[y]; x < dirty_x1[y]; x++) {
+      const CELL c = row[x];
+      const U16 *mask = glyph_masks[(U8)c.glyph];
+      const U32 fg = palette_rgba[c.fg];
+      const U32 bg = palette_rgba[c.bg];
+
+      U32 *dst = &framebuffer[y * FONT_HEIGHT * pitch + x * FONT_WIDTH];
+      for (I row = 0; row < FONT_HEIGHT; row++, dst += pitch)
+        blit_row(dst, mask[row], fg, bg);
+    }
+
+    cells += dirty_x1[y] - dirty_x0[y];
+    y0 = SDL_min(y0, y);
+    y1 = y + 1;
+    mark_clean(y);
+  }
+
+  const SDL_Rect band = {0, y0 * FONT_HEIGHT, pitch, (y1 - y0) * FONT_HEIGHT};
+  SDL_UpdateTexture(streamTex, &band, &framebuffer[y0 * FONT_HEIGHT * pitch], pitch * (I)sizeof(*framebuffer));
+  return cells;
+}
+
+//====================================================cell_eq=====================================================
+static inline SDL_bool cell_eq(CELL a, CELL b) { return a.fg == b.fg && a.bg == b.bg && a.glyph == b.glyph; }
+
+//=================================================set_row_verts==================================================
+// Set the verts of the n cells from x,y on the visible page and mark them dirty
+static V set_row_verts(I x, I y, I n, const CELL *cells) {
+  mark_dirty(y, x, x + n);
+
+  // The palette is already in the vertex color format, so this is just copies out of the two tables. Glyph is
+  // a signed char, extended characters have to go through U8 to find their UVs.
+  SDL_Vertex *cv = &colorVerts[(y * screen_width + x) * 4];
+  SDL_Vertex *gv = &glyphVerts[(y * screen_width + x) * 4];
+  // Everything is read into locals first, otherwise the compiler has to assume every store to a vert may have
+  // changed the tables and reload them.
+  for (I j = 0; j < n; j++, cv += 4, gv += 4) {
+    const CELL c = cells[j];
+    const SDL_Color bg = palette[c.bg];
+    const SDL_Color fg = palette[c.fg];
+    SDL_FPoint uv[4];
+    SDL_memcpy(uv, glyphUVs[(U8)c.glyph], sizeof(uv));
+    for (I i = 0; i < 4; i++) {
+      cv[i].color = bg;
+      gv[i].color = fg;
+      gv[i].tex_coord = uv[i];
     }
+  }
+}
 
-    while (isspace(*song))
-      song++;
+//===================================================set_verts====================================================
+// Set the verts of the cell at x,y on the visible page and mark it dirty
+static V set_verts(I x, I y, CELL c) { set_row_verts(x, y, 1, &c); }
+
+//===================================================show_page====================================================
+// Update the verts to show page instead of the visible page, but only for the cells that differ. Both pages are
+// compared where their rows are kept rather than in screen order, that's how the verts are laid out.
+static V show_page(const CELL *page) {
+  for (I i = 0; i < screen_width * screen_height; i++)
+    if (!cell_eq(screen[i], page[i]))
+      set_verts(i % screen_width, i / screen_width, page[i]);
+}
 
-    switch (*song) {
+//==================================================hash_string===================================================
+// FNV-1a
+static U32 hash_string(CC *s) {
+  U32 hash = 2166136261u;
+  for (; *s; s++)
+    hash = (hash ^ (U8)*s) * 16777619u;
+  return hash;
+}
+
+//=================================================parse_number===================================================
+static SDL_bool parse_number(CC **s, I *n) {
+  C *end;
+  long l = strtol(*s, &end, 10);
+  if (end == *s)
+    return SDL_FALSE;
+  *n = (I)SDL_clamp(l, -0x7FFFFFFF, 0x7FFFFFFF);
+  *s = end;
+  return SDL_TRUE;
+}
+
+//===================================================add_event====================================================
+static SDL_bool add_event(I *count, I freq, I samples) {
+  if (samples <= 0)
+    return SDL_TRUE;
+
+  if (*count == song_scratch_size) {
+    I size = song_scratch_size ? song_scratch_size * 2 : 256;
+    SONG_EVENT *scratch = SDL_realloc(song_scratch, size * sizeof(*scratch));
+    if (!scratch)
+      return SDL_FALSE;
+    song_scratch = scratch;
+    song_scratch_size = size;
+  }
+
+  song_scratch[(*count)++] = (SONG_EVENT){freq, samples};
+  return SDL_TRUE;
+}
+
+//===================================================add_note=====================================================
+// Add a note, followed by the rest between it and the next note for normal and staccato music
+static SDL_bool add_note(I *count, I freq, I samples, I flow) {
+  I on = flow == MUSIC_STACCATO ? samples * 3 / 4 : flow == MUSIC_NORMAL ? samples * 7 / 8 : samples;
+  return add_event(count, freq, on) && add_event(count, 0, samples - on);
+}
+
+//=================================================compile_song===================================================
+// Compile a PLAY string into a SONG, or find it in the cache if it has already been compiled from the same
+// state. Returns NULL if the string has errors.
+static SONG *compile_song(CC *text) {
+  const U32 hash = hash_string(text);
+  for (I i = 0; i < SONG_CACHE_SIZE; i++) {
+    SONG *song = &song_cache[i];
+    if (song->text && song->hash == hash && !SDL_memcmp(&song->start, &song_state, sizeof(song_state)) &&
+        !SDL_strcmp(song->text, text)) {
+      song_state = song->end;
+      return song;
+    }
+  }
+
+  SONG_STATE st = song_state;
+  I count = 0;
+  CC *cmd = text;
+  for (CC *s = text;;) {
+    while (isspace(*s))
+      s++;
+
+    cmd = s;
+    I n;
+    switch (*s++) {
     case 0: // End of song
-      SDL_memset(&stream[sample], 0, (len - sample) * 2);
-      sample = len;
-      break;
+      goto done;
 
     case 'O': // Change octave
-    case 'o': {
-      char *end;
-      long octave = strtol(song + 1, &end, 10);
-      if (end == song + 1) {
-        SDL_LogError(0, "audio_callback: Invalid O command '%s'", song);
-        song = "";
-      } else {
-        song_octave = SDL_clamp(octave, 0, 6);
-        song = end;
-      }
+    case 'o':
+      if (!parse_number(&s, &n))
+        goto invalid;
+      st.octave = SDL_clamp(n, 0, 6);
       break;
-    }
 
     case '<': // Decrease octave
-      song_octave = SDL_clamp(song_octave - 1, 0, 6);
-      song++;
+      st.octave = SDL_clamp(st.octave - 1, 0, 6);
       break;
     case '>': // Increase octive
-      song_octave = SDL_clamp(song_octave + 1, 0, 6);
-      song++;
+      st.octave = SDL_clamp(st.octave + 1, 0, 6);
       break;
 
     case 'a': // Note
@@ -138,182 +524,1061 @@ static void audio_callback(void *, U8 *stream_, I len) {
     case 'f':
     case 'F':
     case 'g':
-    case 'G':
-      song_note = note_frequency[song_octave][letter_to_note[(I)*song]];
-      song_note_duration = (I)((D)song_tempo / song_tempo_div);
-      song++;
+    case 'G': {
+      I freq = note_frequency[st.octave][letter_to_note[(U8)*cmd]];
+      I samples = (I)((D)st.tempo / st.tempo_div);
 
-      switch (*song) {
+      switch (*s) {
       case '+':
-        song_note++;
-        song++;
+        freq++;
+        s++;
         break;
       case '-':
-        song_note--;
-        song++;
+        freq--;
+        s++;
         break;
       case '.':
-        song_note_duration = (I)(song_note_duration * (2.0 / 3.0));
-        song++;
+        samples = (I)(samples * (2.0 / 3.0));
+        s++;
       }
+
+      if (!add_note(&count, freq, samples, st.flow))
+        goto out_of_memory;
       break;
+    }
 
     case 'p': // Rest
     case 'P':
-      char *end;
-      long duration = strtol(song + 1, &end, 10);
-      if (end == song + 1) {
-        SDL_LogError(0, "audio_callback: Invalid P command '%s'", song);
-        song = "";
-      } else {
-        song_note = 0;
-        duration = SDL_clamp(duration, 1, 64);
-        song_note_duration = (I)((D)song_tempo / duration);
-        song = end;
-      }
+      if (!parse_number(&s, &n))
+        goto invalid;
+      n = SDL_clamp(n, 1, 64);
+      if (!add_event(&count, 0, (I)((D)st.tempo / n)))
+        goto out_of_memory;
       break;
 
     case 'n': // Specific note
-    case 'N': {
-      char *end;
-      long note = strtol(song + 1, &end, 10);
-      if (end == song + 1) {
-        SDL_LogError(0, "audio_callback: Invalid N command '%s'", song);
-        song = "";
-      } else {
-        note = SDL_clamp(note, 0, 84);
-        song_note = note_frequency[note / 12][note % 12];
-        song_note_duration = (I)((D)song_tempo / song_tempo_div);
-        song = end;
-      }
+    case 'N':
+      if (!parse_number(&s, &n))
+        goto invalid;
+      n = SDL_clamp(n, 0, 84);
+      if (!add_note(&count, note_frequency[n / 12][n % 12], (I)((D)st.tempo / st.tempo_div), st.flow))
+        goto out_of_memory;
       break;
-    }
 
     case 'l': // Note length divisor
-    case 'L': {
-      char *end;
-      long div = strtol(song + 1, &end, 10);
-      if (end == song + 1) {
-        SDL_LogError(0, "audio_callback: Invalid L command '%s'", song);
-        song = "";
-      } else {
-        div = SDL_clamp(div, 1, 64);
-        song_tempo_div = div;
-        song = end;
-      }
+    case 'L':
+      if (!parse_number(&s, &n))
+        goto invalid;
+      st.tempo_div = SDL_clamp(n, 1, 64);
       break;
-    }
 
     case 'm': // Music parameter
     case 'M':
-      switch (song[1]) {
+      switch (*s++) {
       case 'l': // Music legato
       case 'L':
-        song_flow = MUSIC_LEGATO;
-        song += 2;
+        st.flow = MUSIC_LEGATO;
         break;
       case 'n': // Music normal
       case 'N':
-        song_flow = MUSIC_NORMAL;
-        song += 2;
+        st.flow = MUSIC_NORMAL;
         break;
       case 's': // Music staccato
       case 'S':
-        song_flow = MUSIC_STACCATO;
-        song += 2;
+        st.flow = MUSIC_STACCATO;
         break;
-      case 'f': // Music foreground (ignored)
+      case 'f': // Music foreground
       case 'F':
-      case 'b': // Music background (ignored)
+        st.background = SDL_FALSE;
+        break;
+      case 'b': // Music background
       case 'B':
-        song += 2;
+        st.background = SDL_TRUE;
         break;
       default:
-        SDL_LogError(0, "audio_callback: Invalid M command '%s'", song);
-        song = "";
+        goto invalid;
       }
       break;
 
     case 't': // Tempo
-    case 'T': {
-      char *end;
-      long tempo = strtol(song + 1, &end, 10);
-      if (end == song + 1) {
-        SDL_LogError(0, "audio_callback: Invalid T command '%s'", song);
-        song = "";
-      }
-      tempo = SDL_clamp(tempo, 32, 255);
+    case 'T':
+      if (!parse_number(&s, &n))
+        goto invalid;
+      n = SDL_clamp(n, 32, 255);
 
       // The T command is in quarter notes per minute, convert this to samples per whole note
-      song_tempo = (I)(audio_spec.freq / (1.0 / (tempo / 4.0 / 60.0)));
-      song = end;
+      st.tempo = (I)(audio_spec.freq / (1.0 / (n / 4.0 / 60.0)));
       break;
+
+    default:
+      goto invalid;
     }
+  }
+
+invalid:
+  SDL_LogError(0, "PLAY: Invalid command '%s'", cmd);
+  return NULL;
+
+out_of_memory:
+  SDL_LogError(0, "PLAY: Out of memory");
+  return NULL;
+
+done:;
+  // Find a free slot, or evict the least recently used song that audio_callback is done with
+  const U32 tail = (U32)SDL_AtomicGet(&audio_queue_tail);
+  SONG *song = NULL;
+  for (I i = 0; i < SONG_CACHE_SIZE; i++) {
+    SONG *slot = &song_cache[i];
+    if (slot->queued && !(slot->replaced && (I32)(tail - slot->replaced_by) > 0))
+      continue;
+    if (!song || !slot->text || slot->used < song->used)
+      song = slot;
+    if (!slot->text)
+      break;
+  }
+  if (!song) {
+    SDL_LogError(0, "PLAY: Every cached song is still in use by the audio device");
+    return NULL;
+  }
+
+  SONG_EVENT *events = SDL_malloc(SDL_max(count, 1) * sizeof(*events));
+  C *copy = SDL_strdup(text);
+  if (!events || !copy) {
+    SDL_free(events);
+    SDL_free(copy);
+    goto out_of_memory;
+  }
+  if (count)
+    SDL_memcpy(events, song_scratch, count * sizeof(*events));
+
+  SDL_free(song->text);
+  SDL_free(song->events);
+  *song = (SONG){.text = copy, .hash = hash, .start = song_state, .end = st, .events = events, .count = count};
+  song_state = st;
+  return song;
+}
+
+//==================================================synthesize====================================================
+// Mix n samples of the wavetable starting at phase into mix, returning the phase after the last sample. The top
+// WAVETABLE_BITS of the phase are the wavetable index, the next 16 bits lerp to the following sample. Everything
+// is integer and branch free, and wraparound is just the U32 overflowing.
+static U32 synthesize(I32 *restrict mix, I n, U32 phase, U32 inc) {
+  for (I i = 0; i < n; i++) {
+    const U32 p = phase + (U32)i * inc;
+    const U32 index = p >> (32 - WAVETABLE_BITS);
+    const I32 t = (I32)(p >> (16 - WAVETABLE_BITS) & 0xFFFF);
+    mix[i] += wavetable[index] + (wavetable_step[index] * t >> 16);
+  }
+  return phase + (U32)n * inc;
+}
 
-    default: // Invalid song
-      SDL_LogError(0, "audio_callback: Invalid command '%s'", song);
-      song = "";
+//===================================================mix_voice====================================================
+static V mix_voice(VOICE *v, I32 *mix, I n) {
+  for (I sample = 0; sample < n;) {
+    // Move on to the next event when the current note is done, or free the voice at the end of its events
+    if (v->duration == 0) {
+      if (v->event >= v->count) {
+        if (v == &voices[0])
+          SDL_AtomicSet(&audio_music_done, (I)(v->pos + 1));
+        v->events = NULL;
+        return;
+      }
+      v->note = v->events[v->event].freq;
+      v->duration = v->events[v->event].samples;
+      v->inc = (U32)(I64)((D)v->note * 4294967296.0 / audio_spec.freq);
+      v->event++;
+      continue;
     }
+
+    // Synthesize the whole part of the note that fits in this block at once. If the note is 0 then this is a
+    // rest, which adds nothing to the mix.
+    const I d = SDL_min(v->duration, n - sample);
+    if (v->note != 0)
+      v->phase = synthesize(&mix[sample], d, v->phase, v->inc);
+    v->duration -= d;
+    sample += d;
   }
+}
 
-  if (tries == 1000) {
-    SDL_LogError(0, "audio_callback: tries exhausted, something is wrong with the song");
-    SDL_LogError(0, "%s", song);
-    song = "";
+//=================================================audio_enqueue==================================================
+// Send a command to audio_callback, returning its position in the queue. Only the main thread may call this.
+static SDL_bool audio_enqueue(const AUDIO_COMMAND *cmd, U32 *pos) {
+  if (!audio_device && !audio_offline)
+    return SDL_FALSE;
+
+  const U32 head = (U32)SDL_AtomicGet(&audio_queue_head);
+  const U32 tail = (U32)SDL_AtomicGet(&audio_queue_tail);
+  if (head - tail == AUDIO_QUEUE_SIZE) {
+    SDL_LogError(0, "Audio queue is full, dropping command");
+    return SDL_FALSE;
   }
+
+  audio_queue[head & (AUDIO_QUEUE_SIZE - 1)] = *cmd;
+  SDL_MemoryBarrierRelease(); // The command must be written before the head moves past it
+  SDL_AtomicSet(&audio_queue_head, (I)(head + 1));
+
+  if (pos)
+    *pos = head;
+  return SDL_TRUE;
 }
 
-//=====================================================START======================================================
-V START(const C *window_title) {
-  srand(time(0));
+//=================================================audio_report===================================================
+// Send a message to the main thread. Only audio_callback may call this, a full ring drops the message.
+static V audio_report(I type, I a, I b) {
+  const U32 head = (U32)SDL_AtomicGet(&audio_log_head);
+  const U32 tail = (U32)SDL_AtomicGet(&audio_log_tail);
+  if (head - tail == AUDIO_LOG_SIZE) {
+    SDL_AtomicAdd(&audio_log_dropped, 1);
+    return;
+  }
 
-  // Initialize SDL and create the window
-  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO)) {
-    SDL_LogCritical(0, "START Failed to initialize SDL: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+  audio_log[head & (AUDIO_LOG_SIZE - 1)] = (AUDIO_LOG){type, a, b};
+  SDL_MemoryBarrierRelease(); // The message must be written before the head moves past it
+  SDL_AtomicSet(&audio_log_head, (I)(head + 1));
+}
+
+//=================================================audio_dequeue==================================================
+// Take every command the main thread has sent. Only audio_callback may call this, at the start of a buffer.
+static V audio_dequeue() {
+  U32 tail = (U32)SDL_AtomicGet(&audio_queue_tail);
+  const U32 head = (U32)SDL_AtomicGet(&audio_queue_head);
+  SDL_MemoryBarrierAcquire(); // Don't read the commands before the head that published them
+
+  for (; tail != head; tail++) {
+    const AUDIO_COMMAND *cmd = &audio_queue[tail & (AUDIO_QUEUE_SIZE - 1)];
+    switch (cmd->type) {
+    case AUDIO_PLAY: // Replace the music, ending the current note early
+      voices[0] = (VOICE){.events = cmd->events, .count = cmd->count, .phase = voices[0].phase, .pos = tail};
+      break;
+
+    case AUDIO_SOUND: { // Take a free effect voice, or steal the oldest one
+      VOICE *v = &voices[1];
+      for (I i = 1; i < AUDIO_VOICES; i++) {
+        if (!voices[i].events) {
+          v = &voices[i];
+          break;
+        }
+        if ((I32)(voices[i].pos - v->pos) < 0)
+          v = &voices[i];
+      }
+      *v = (VOICE){.sound = cmd->sound, .count = 1, .pos = tail};
+      v->events = &v->sound;
+      break;
+    }
+
+    default: // Skip it, the main thread never sends these
+      audio_report(AUDIO_LOG_COMMAND, (I)tail, cmd->type);
+      break;
+    }
   }
 
-  window = SDL_CreateWindow(                          //
-      window_title,                                   //
-      SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, //
-      WINDOW_WIDTH, WINDOW_HEIGHT,                    //
-      SDL_WINDOW_RESIZABLE);                          //
-  if (!window) {
-    SDL_LogCritical(0, "START Failed to create window: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+  SDL_MemoryBarrierRelease(); // Finish reading the commands before handing their slots back
+  SDL_AtomicSet(&audio_queue_tail, (I)tail);
+}
+
+//================================================audio_callback==================================================
+static void audio_callback(void *, U8 *stream_, I len) {
+  const U64 start_ticks = SDL_GetPerformanceCounter();
+  I16 *stream = (I16 *)stream_;
+  len /= 2;
+
+  audio_dequeue();
+
+  // Mix every active voice into a block, then saturate the block into the stream. Free voices cost nothing.
+  for (I start = 0; start < len; start += AUDIO_BLOCK) {
+    const I n = SDL_min(AUDIO_BLOCK, len - start);
+    I32 mix[AUDIO_BLOCK] = {0};
+
+    for (I i = 0; i < AUDIO_VOICES; i++)
+      if (voices[i].events)
+        mix_voice(&voices[i], mix, n);
+
+    for (I i = 0; i < n; i++)
+      stream[start + i] = (I16)SDL_clamp(mix[i], -32768, 32767);
   }
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE);
-  if (!renderer) {
-    SDL_LogCritical(0, "START Failed to create renderer: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+  // Compare the time this buffer took with the time it will play for. Only a new slowest buffer is reported, so a
+  // callback that is always late can't flood the log.
+  const U64 freq = SDL_GetPerformanceFrequency();
+  const U64 ticks = SDL_GetPerformanceCounter() - start_ticks;
+  const U64 budget = (U64)len * freq / (U64)SDL_max(audio_spec.freq, 1);
+  const SDL_bool late = ticks * 100 >= budget * AUDIO_LATE;
+  if (late && ticks > audio_counters.max_ticks)
+    audio_report(AUDIO_LOG_LATE, (I)(ticks * 1000000 / freq), (I)(budget * 1000000 / freq));
+
+  SDL_AtomicAdd(&audio_counters_seq, 1);
+  SDL_MemoryBarrierRelease(); // The sequence must be odd before any counter changes
+  audio_counters.callbacks++;
+  audio_counters.ticks += ticks;
+  audio_counters.max_ticks = SDL_max(audio_counters.max_ticks, ticks);
+  audio_counters.late += late;
+  SDL_MemoryBarrierRelease(); // and every counter must be written before it's even again
+  SDL_AtomicAdd(&audio_counters_seq, 1);
+}
+
+//================================================drain_audio_log=================================================
+// Log the messages audio_callback has sent. Only the main thread may call this.
+static V drain_audio_log() {
+  U32 tail = (U32)SDL_AtomicGet(&audio_log_tail);
+  const U32 head = (U32)SDL_AtomicGet(&audio_log_head);
+  SDL_MemoryBarrierAcquire(); // Don't read the messages before the head that published them
+
+  for (; tail != head; tail++) {
+    const AUDIO_LOG m = audio_log[tail & (AUDIO_LOG_SIZE - 1)];
+    switch (m.type) {
+    case AUDIO_LOG_COMMAND:
+      SDL_LogError(0, "Audio skipped command %u of unknown type %d", (U)m.a, m.b);
+      break;
+    case AUDIO_LOG_LATE:
+      SDL_LogWarn(0, "Audio buffer took %d us of the %d us it plays for, the slowest yet", m.a, m.b);
+      break;
+    }
+  }
+
+  SDL_MemoryBarrierRelease(); // Finish reading the messages before handing their slots back
+  SDL_AtomicSet(&audio_log_tail, (I)tail);
+}
+
+//==================================================fire_timers===================================================
+// Call the timers due this frame. Only the timer_wheel slot for this frame is visited, and timers a whole turn of
+// the wheel or more away are just put back. Deleted timers are freed here too, so TIMER_SET, TIMER_KILL and
+// TIMER_RESET are all safe to call from a callback.
+static V fire_timers() {
+  const I slot = timer & (TIMER_WHEEL_SIZE - 1);
+  I next = timer_wheel[slot];
+  timer_wheel[slot] = 0;
+
+  for (I i = next; i; i = next) {
+    TIMER_ENTRY *t = &timers[i];
+    next = t->next;
+
+    if (!t->func) {
+      t->next = timers_free;
+      timers_free = i;
+      continue;
+    }
+
+    V (*func)(V) = NULL;
+    if (t->due == (U32)timer) {
+      func = t->func;
+      t->due += (U32)t->period;
+    }
+    const I due_slot = (I)(t->due & (TIMER_WHEEL_SIZE - 1));
+    t->next = timer_wheel[due_slot];
+    timer_wheel[due_slot] = i;
+
+    // The callback may grow timers, so t can't be used after this
+    if (func && timers_on)
+      func();
+  }
+}
+
+//====================================================get_key=====================================================
+static inline SDL_bool get_key(const U32 *set, SCAN scan) {
+  return scan >= 0 && scan < SDL_NUM_SCANCODES && set[scan / 32] >> (scan % 32) & 1;
+}
+
+//====================================================set_key=====================================================
+static inline V set_key(U32 *set, SCAN scan, SDL_bool on) {
+  if (on)
+    set[scan / 32] |= 1u << (scan % 32);
+  else
+    set[scan / 32] &= ~(1u << (scan % 32));
+}
+
+//===================================================key_down=====================================================
+static V key_down(SCAN scan) {
+  if (scan <= SDL_SCANCODE_UNKNOWN || scan >= SDL_NUM_SCANCODES || get_key(keys_down, scan))
+    return;
+  set_key(keys_down, scan, SDL_TRUE);
+  set_key(keys_just, scan, SDL_TRUE);
+  held_keys[held_count++] = scan;
+  held_frames[scan] = 1;
+}
+
+//====================================================key_up======================================================
+static V key_up(SCAN scan) {
+  if (scan <= SDL_SCANCODE_UNKNOWN || scan >= SDL_NUM_SCANCODES || !get_key(keys_down, scan))
+    return;
+  set_key(keys_down, scan, SDL_FALSE);
+  set_key(keys_up, scan, SDL_TRUE);
+  for (I i = 0; i < held_count; i++)
+    if (held_keys[i] == scan)
+      held_keys[i] = held_keys[--held_count];
+}
+
+//=================================================record_input===================================================
+static V record_input(INPUT_EVENT e) {
+  U8 buf[INPUT_EVENT_SIZE];
+  const U32 fields[] = {e.frame, (U32)e.type | (U32)e.repeat << 8 | (U32)e.scan << 16, (U32)e.value};
+  for (I i = 0; i < INPUT_EVENT_SIZE; i++)
+    buf[i] = (U8)(fields[i / 4] >> (8 * (i % 4)));
+  if (SDL_RWwrite(record_file, buf, sizeof(buf), 1) != 1) {
+    SDL_LogError(0, "Failed to record input, recording stopped: %s", SDL_GetError());
+    SDL_RWclose(record_file);
+    record_file = NULL;
+  }
+}
+
+//===================================================key_event====================================================
+// Handle a key event from SDL or a replay
+static V key_event(INPUT_EVENT e) {
+  if (record_file)
+    record_input(e);
+
+  if (e.type == INPUT_KEYUP) {
+    key_up(e.scan);
+    return;
+  }
+
+  // The OS's own repeats go in the key buffer, but the held keys do their own typematic
+  if (!e.repeat)
+    key_down(e.scan);
+  I new_end = (key_buffer_end + 1) % SDL_arraysize(key_buffer);
+  if (new_end == key_buffer_start) {
+    BEEP();
+  } else {
+    key_buffer[key_buffer_end] = e.value;
+    key_buffer_end = new_end;
   }
+}
 
-  SDL_RenderSetLogicalSize(renderer, WINDOW_WIDTH, WINDOW_HEIGHT);
-  SDL_SetWindowMinimumSize(window, WINDOW_WIDTH, WINDOW_HEIGHT);
+//==================================================seed_random===================================================
+// Seed the random number generator, with the recorded seed instead when replaying
+static V seed_random(I n) {
+  if (replay_events) {
+    while (replay_seed < replay_count && replay_events[replay_seed].type != INPUT_SEED)
+      replay_seed++;
+    if (replay_seed < replay_count)
+      n = replay_events[replay_seed++].value;
+    else
+      SDL_LogError(0, "Replay has no more seeds, the replay will go its own way");
+  }
+  if (record_file)
+    record_input((INPUT_EVENT){.frame = (U32)timer, .type = INPUT_SEED, .value = n});
+  RNG_SEED(&random_rng, (U32)n, 0);
+}
+
+//================================================compare_floats==================================================
+static I compare_floats(const V *a, const V *b) {
+  const float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+//==================================================pcg_output====================================================
+// PCG32's XSH RR output function, a permutation of the LCG state before it steps
+static inline U32 pcg_output(U64 state) {
+  const U32 xorshifted = (U32)(((state >> 18) ^ state) >> 27);
+  const U32 rot = (U32)(state >> 59);
+  return xorshifted >> rot | xorshifted << (-rot & 31);
+}
+
+//====================================================profile=====================================================
+// Charge the time since the end of the last phase to phase. This is all profiling costs when it's off.
+static inline V profile(I phase) {
+  if (!profile_flags)
+    return;
+  const U64 now = SDL_GetPerformanceCounter();
+  profile_ticks[phase] += now - profile_last;
+  profile_last = now;
+}
+
+//=================================================profile_frame==================================================
+// Record the frame that just ended in profile_ring, and in profile_log if it's going to a CSV
+static V profile_frame() {
+  const D ms = 1000.0 / (D)SDL_GetPerformanceFrequency();
+  float *sample = profile_ring[profile_frames % PROFILE_FRAMES];
+  for (I i = 0; i < PROFILE_PHASES; i++)
+    sample[i] = (float)(profile_ticks[i] * ms);
+  sample[PROFILE_SETS] = (float)profile_sets;
+  SDL_zeroa(profile_ticks);
+
+  if (profile_csv) {
+    if (profile_frames == profile_log_size) {
+      const I size = SDL_max(profile_log_size * 2, 4096);
+      float(*grown)[PROFILE_PHASES] = SDL_realloc(profile_log, size * sizeof(*profile_log));
+      if (grown) {
+        profile_log = grown;
+        profile_log_size = size;
+      }
+    }
+    if (profile_frames < profile_log_size)
+      SDL_memcpy(profile_log[profile_frames], sample, sizeof(*profile_log));
+  }
+  profile_frames++;
+}
+
+//=================================================draw_overlay===================================================
+// Draw the p99 of every phase over the bottom row of the visible page. The text only changes every
+// PROFILE_REFRESH frames, in between only what has been drawn over the row since the last frame is covered again.
+static V draw_overlay() {
+  // If the screen scrolled, the row the overlay was covering needs putting back
+  const I y = screen_rows[screen_height - 1];
+  if (profile_row_y >= 0 && profile_row_y != y) {
+    set_row_verts(0, profile_row_y, screen_width, row_at(screen, profile_row_y));
+    profile_row_y = -1;
+  }
+
+  I x0 = dirty_x0[y], x1 = dirty_x1[y];
+  if (profile_row_y < 0 || profile_frames % PROFILE_REFRESH == 1 || profile_frames == 0) {
+    C text[SCREEN_MAX_WIDTH + 1];
+    I len = 0;
+    for (I i = 0; i < PROFILE_PHASES && len < screen_width; i++)
+      len += SDL_snprintf(&text[len], sizeof(text) - len, "%.3s %.*f ", profile_names[i],
+                          i == PROFILE_SETS ? 0 : 1, PROFILE_GET(i).p99);
+    len = SDL_min(len, screen_width);
+    for (I x = 0; x < screen_width; x++)
+      profile_row[x] = (CELL){.fg = YELLOW, .bg = BLUE, .glyph = x < len ? text[x] : ' '};
+    x0 = 0;
+    x1 = screen_width;
+  }
+  profile_row_y = y;
+  if (x0 < x1)
+    set_row_verts(x0, y, x1 - x0, &profile_row[x0]);
+}
+
+//=================================================write_profile==================================================
+// Write profile_log to profile_csv, one row per frame
+static V write_profile() {
+  SDL_RWops *file = SDL_RWFromFile(profile_csv, "wb");
+  if (!file) {
+    SDL_LogError(0, "END Failed to open %s: %s", profile_csv, SDL_GetError());
+    return;
+  }
+
+  C line[512];
+  I len = SDL_snprintf(line, sizeof(line), "frame");
+  for (I i = 0; i < PROFILE_PHASES; i++)
+    len += SDL_snprintf(&line[len], sizeof(line) - len, i == PROFILE_SETS ? ",%s\n" : ",%s_ms", profile_names[i]);
+  SDL_bool ok = SDL_RWwrite(file, line, len, 1) == 1;
+
+  for (I f = 0; ok && f < SDL_min(profile_frames, profile_log_size); f++) {
+    len = SDL_snprintf(line, sizeof(line), "%d", f);
+    for (I i = 0; i < PROFILE_PHASES; i++)
+      len += SDL_snprintf(&line[len], sizeof(line) - len, i == PROFILE_SETS ? ",%.0f\n" : ",%.4f",
+                          profile_log[f][i]);
+    ok = SDL_RWwrite(file, line, len, 1) == 1;
+  }
+
+  if (SDL_RWclose(file) != 0 || !ok)
+    SDL_LogError(0, "END Failed to write %s: %s", profile_csv, SDL_GetError());
+}
+
+//==================================================wait_frame====================================================
+// Hold UPDATE to FRAME_RATE whatever the monitor's refresh rate. Deadlines are counted from frame_epoch rather
+// than from the last frame so rounding never accumulates. Most of the wait is slept away, the last FRAME_SPIN_MS
+// is spun because SDL_Delay can oversleep by a whole scheduler tick.
+static V wait_frame() {
+  const U64 freq = SDL_GetPerformanceFrequency();
+  U64 now = SDL_GetPerformanceCounter();
+
+  frame_count++;
+  U64 deadline = frame_epoch + frame_count * freq / FRAME_RATE;
+
+  // On the first frame, or after falling too far behind (a breakpoint, a dragged window, a long load) start the
+  // clock over from now instead of rushing through the missed frames
+  if (frame_epoch == 0 || (I64)(now - deadline) > (I64)(FRAME_MAX_LAG * freq / FRAME_RATE)) {
+    frame_epoch = now;
+    frame_count = 0;
+    return;
+  }
+
+  while ((I64)(deadline - now) > (I64)(FRAME_SPIN_MS * freq / 1000)) {
+    SDL_Delay((U32)((deadline - now) * 1000 / freq) - (FRAME_SPIN_MS - 1));
+    now = SDL_GetPerformanceCounter();
+  }
+  while ((I64)(deadline - now) > 0)
+    now = SDL_GetPerformanceCounter();
+}
+
+//==================================================rotate_rows===================================================
+// Rotate rows top to bottom of a page up by n rows, or down if n is negative, where 0 < |n| <= bottom - top + 1.
+// Only page_rows changes, the |n| rows that came round still hold what went off the other end. Returns the first.
+static I rotate_rows(I page, I top, I bottom, I n) {
+  // Up moves the top n rows to the bottom, down moves the bottom n to the top
+  const I count = bottom - top + 1;
+  U8 *rows = rows_at(page);
+  U8 moved[SCREEN_MAX_HEIGHT];
+  const I k = n > 0 ? n : count + n;
+  SDL_memcpy(moved, &rows[top], k);
+  SDL_memmove(&rows[top], &rows[top + k], count - k);
+  SDL_memcpy(&rows[top + count - k], moved, k);
+
+  // Even when no cell changes, the rows are in a new order on screen
+  if (page == visible_page)
+    needs_present = SDL_TRUE;
+  return n > 0 ? bottom - n + 1 : top;
+}
 
-  // Initialize the position of the color and glyph verts. Their colors and texture coordinates will be set
-  // when the screen is cleared at the end of this function, but their positions never change and are set here.
-  for (I y = 0, i = 0; y < SCREEN_HEIGHT; y++) {
-    for (I x = 0; x < SCREEN_WIDTH; x++, i++) {
+//==================================================scroll_page===================================================
+// Scroll rows top to bottom of a page up by n rows, or down if n is negative. The rows are rotated in
+// page_rows, so only the rows scrolled in cost anything. They're cleared to the cursor color.
+static V scroll_page(I page, I top, I bottom, I n) {
+  const I count = bottom - top + 1;
+  n = SDL_clamp(n, -count, count);
+  if (n == 0 || count <= 0)
+    return;
+  if (page == camera_page)
+    camera_page = -1;
+
+  const I first = rotate_rows(page, top, bottom, n);
+  const U8 *rows = rows_at(page);
+  const CELL blank = {.fg = cursor_fg, .bg = cursor_bg, .glyph = ' '};
+  for (I y = first; y < first + SDL_abs(n); y++) {
+    CELL *row = row_at(page_at(page), rows[y]);
+    for (I x = 0; x < screen_width; x++)
+      row[x] = blank;
+    if (page == visible_page)
+      set_row_verts(0, rows[y], screen_width, row);
+  }
+}
+
+//===================================================copy_rows====================================================
+// Copy tex, which has its rows where the visible page keeps them, to an area of the render target in screen
+// order. Rows kept one after another are copied together, a page that was scrolled n times takes 2 copies.
+static V copy_rows(SDL_Texture *tex, SDL_Rect area) {
+  const I h = area.h;
+  for (I y = 0; y < screen_height;) {
+    const I start = y;
+    const I first = screen_rows[y];
+    while (++y < screen_height && screen_rows[y] == screen_rows[y - 1] + 1)
+      ;
+    const SDL_Rect src = {0, first * FONT_HEIGHT, screen_width * FONT_WIDTH, (y - start) * FONT_HEIGHT};
+    const I y0 = area.y + start * h / screen_height;
+    const SDL_Rect dst = {area.x, y0, area.w, area.y + y * h / screen_height - y0};
+    SDL_RenderCopy(renderer, tex, &src, &dst);
+  }
+}
+
+//===================================================world_at=====================================================
+// The world cell at x,y, which must be inside the world
+static inline CELL *world_at(I x, I y) {
+  const Z tile = (Z)(y >> WORLD_TILE_BITS) * world_tiles + (x >> WORLD_TILE_BITS);
+  return &world[tile * WORLD_TILE * WORLD_TILE + (y & WORLD_TILE_MASK) * WORLD_TILE + (x & WORLD_TILE_MASK)];
+}
+
+//===================================================world_row====================================================
+// Copy n cells of world row y from x into out, with world_fill where that's outside the world. The row is
+// contiguous within each tile, so it's copied a tile at a time.
+static V world_row(I x, I y, I n, CELL *out) {
+  I i = 0;
+  if (y >= 0 && y < world_h) {
+    for (; i < n && x + i < 0; i++)
+      out[i] = world_fill;
+    while (i < n && x + i < world_w) {
+      const I wx = x + i;
+      const I run = SDL_min(SDL_min(n - i, world_w - wx), WORLD_TILE - (wx & WORLD_TILE_MASK));
+      SDL_memcpy(&out[i], world_at(wx, y), run * sizeof(CELL));
+      i += run;
+    }
+  }
+  for (; i < n; i++)
+    out[i] = world_fill;
+}
+
+//==================================================camera_row====================================================
+// Draw the world row the camera shows on row y of the active page. Only the span of cells that differ from what
+// the row already holds is written, so a camera that moved sideways over a plain floor sets few verts.
+static V camera_row(I y) {
+  CELL cells[SCREEN_MAX_WIDTH];
+  world_row(camera_x, camera_y + y, screen_width, cells);
+
+  const I py = active_rows[y];
+  CELL *row = row_at(active, py);
+  I x0 = 0, x1 = screen_width;
+  while (x0 < x1 && cell_eq(row[x0], cells[x0]))
+    x0++;
+  while (x1 > x0 && cell_eq(row[x1 - 1], cells[x1 - 1]))
+    x1--;
+  if (x0 == x1)
+    return;
+
+  SDL_memcpy(&row[x0], &cells[x0], (x1 - x0) * sizeof(CELL));
+  if (active == screen)
+    set_row_verts(x0, py, x1 - x0, &row[x0]);
+  profile_sets += x1 - x0;
+}
+
+//==================================================scale_rect====================================================
+// Where the screen goes in a w by h output. SCALE_INTEGER takes the largest whole multiple of the screen's pixels
+// that fits, the other modes and a screen too big for any multiple take the largest area with the aspect of
+// WINDOW_WIDTH by WINDOW_HEIGHT, as the text modes filled a 4:3 monitor whatever their size.
+static SDL_Rect scale_rect(I w, I h) {
+  const I sw = screen_width * FONT_WIDTH;
+  const I sh = screen_height * FONT_HEIGHT;
+  const I k = SDL_min(w / sw, h / sh);
+  I rw = w, rh = h;
+  if (scale_mode == SCALE_INTEGER && k >= 1) {
+    rw = sw * k;
+    rh = sh * k;
+  } else if ((I64)w * WINDOW_HEIGHT > (I64)h * WINDOW_WIDTH) {
+    rw = (I)((I64)h * WINDOW_WIDTH / WINDOW_HEIGHT);
+  } else {
+    rh = (I)((I64)w * WINDOW_HEIGHT / WINDOW_WIDTH);
+  }
+  return (SDL_Rect){(w - rw) / 2, (h - rh) / 2, rw, rh};
+}
+
+//====================================================put_row=====================================================
+// Write n cells to row y of the active page from x, clipped to the screen, and to the verts in one go when it's
+// the visible page. The bulk drawing functions all come down to this.
+static V put_row(I x, I y, I n, const CELL *cells) {
+  if (y < 0 || y >= screen_height)
+    return;
+  if (x < 0) {
+    cells -= x;
+    n += x;
+    x = 0;
+  }
+  n = SDL_min(n, screen_width - x);
+  if (n <= 0)
+    return;
+
+  if (active_page == camera_page)
+    camera_rows = SDL_FALSE;
+  const I py = active_rows[y];
+  CELL *row = &row_at(active, py)[x];
+  SDL_memcpy(row, cells, n * sizeof(CELL));
+  if (active == screen)
+    set_row_verts(x, py, n, row);
+  profile_sets += n;
+}
+
+//==================================================print_locate==================================================
+// LOCATE the cursor after printing, keeping track of whether that took it off the bottom of the VIEW_PRINT region
+static V print_locate(I x, I y) {
+  const SDL_bool in_view = cursor_below_view || (cursor_y >= view_top && cursor_y <= view_bottom);
+  LOCATE(x, y);
+  cursor_below_view = in_view && cursor_y > view_bottom;
+}
+
+//===================================================write_run====================================================
+// Write n glyphs at the cursor in the cursor color and move the cursor past them. The glyphs are written a row at
+// a time, the cells and their verts in one pass. Text that runs off the bottom of the VIEW_PRINT region scrolls
+// it up first, like QBasic. Text LOCATEd below the region, such as a status line, is written where it is.
+static V write_run(const C *text, I n) {
+  if (active_page == camera_page)
+    camera_rows = SDL_FALSE;
+  while (n > 0) {
+    if (cursor_below_view || cursor_y >= screen_height) {
+      scroll_page(active_page, view_top, view_bottom, cursor_y - view_bottom);
+      cursor_y = view_bottom;
+      cursor_below_view = SDL_FALSE;
+    }
+
+    const I len = SDL_min(n, screen_width - cursor_x);
+    const I y = active_rows[cursor_y];
+    CELL *row = &row_at(active, y)[cursor_x];
+    for (I i = 0; i < len; i++)
+      row[i] = (CELL){.fg = cursor_fg, .bg = cursor_bg, .glyph = text[i]};
+    if (active == screen)
+      set_row_verts(cursor_x, y, len, row);
+    profile_sets += len;
+
+    print_locate(cursor_x + len, cursor_y);
+    text += len;
+    n -= len;
+  }
+}
+
+//==================================================print_text====================================================
+// Print up to n characters of text at the cursor, stopping early at a NUL. Runs of plain characters go to
+// write_run in one piece, the control characters \a, \b, \n, \r and \t are acted on.
+static V print_text(const C *text, I n) {
+  for (I i = 0; i < n && text[i];) {
+    I run = i;
+    while (run < n && text[run] && !((text[run] >= '\a' && text[run] <= '\n') || text[run] == '\r'))
+      run++;
+    if (run > i) {
+      write_run(&text[i], run - i);
+      i = run;
+      continue;
+    }
+
+    switch (text[i++]) {
+    case '\a':
+      BEEP();
+      break;
+    case '\b':
+      print_locate(cursor_x - 1, cursor_y);
+      break;
+    case '\n': // Off the bottom of the region already, so the line the cursor is on is scrolled into view first
+      if (cursor_below_view || cursor_y >= screen_height) {
+        scroll_page(active_page, view_top, view_bottom, 1);
+        print_locate(0, cursor_y);
+      } else {
+        print_locate(0, cursor_y + 1);
+      }
+      break;
+    case '\r':
+      print_locate(0, cursor_y);
+      break;
+    case '\t': // Move to the next tab stop, every 8 columns
+      print_locate((cursor_x / 8 + 1) * 8, cursor_y);
+      break;
+    }
+  }
+}
+
+//===================================================set_scale====================================================
+// Set the scaling of the screen textures for a SCALE_ mode, and make or free the big texture of SCALE_SMOOTH to
+// match the text mode. Without the big texture SCALE_SMOOTH looks like SCALE_FILTERED.
+static V set_scale(I mode) {
+  scale_mode = mode;
+  const SDL_ScaleMode filter = mode == SCALE_FILTERED ? SDL_ScaleModeLinear : SDL_ScaleModeNearest;
+  SDL_SetTextureScaleMode(screenTex, filter);
+  SDL_SetTextureScaleMode(streamTex, filter);
+
+  if (bigScreenTex) {
+    SDL_DestroyTexture(bigScreenTex);
+    bigScreenTex = NULL;
+  }
+
+  // Smoothing only matters to someone looking at a window
+  if (mode != SCALE_SMOOTH || headless)
+    return;
+  bigScreenTex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET,
+                                   screen_width * FONT_WIDTH * 3, screen_height * FONT_HEIGHT * 3);
+  if (!bigScreenTex) {
+    SDL_LogError(0, "SCALE Failed to create big screen texture: %s", SDL_GetError());
+    return;
+  }
+  SDL_SetTextureScaleMode(bigScreenTex, SDL_ScaleModeLinear);
+}
+
+//===================================================set_mode=====================================================
+// Switch to a cols by rows text mode, with every page blank. The new arena and textures are all made before the
+// old ones are let go, so if any of them can't be made the old mode carries on untouched. Only the big texture
+// of SCALE_SMOOTH is made afterwards, it's optional.
+static SDL_bool set_mode(I cols, I rows) {
+  // The arena is carved into 16 byte aligned pieces in this order
+  const Z cells = (Z)cols * rows;
+  const Z sizes[] = {
+      cells * 4 * sizeof(SDL_Vertex),                 // colorVerts
+      cells * 4 * sizeof(SDL_Vertex),                 // glyphVerts
+      cells * 6 * sizeof(I),                          // quadIndices
+      cells * FONT_WIDTH * FONT_HEIGHT * sizeof(U32), // framebuffer
+      SCREEN_PAGES * cells * sizeof(CELL),            // pages
+      rows * sizeof(I),                               // dirty_x0
+      rows * sizeof(I),                               // dirty_x1
+      cols * sizeof(CELL),                            // profile_row
+      SCREEN_PAGES * rows,                            // page_rows
+  };
+  Z offsets[SDL_arraysize(sizes)];
+  Z size = 0;
+  for (Z i = 0; i < SDL_arraysize(sizes); i++) {
+    offsets[i] = size;
+    size += (sizes[i] + 15) & ~(Z)15;
+  }
+
+  U8 *mem = SDL_calloc(1, size);
+  SDL_Texture *screen_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET,
+                                              cols * FONT_WIDTH, rows * FONT_HEIGHT);
+  SDL_Texture *stream_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING,
+                                              cols * FONT_WIDTH, rows * FONT_HEIGHT);
+
+  if (!mem || !screen_tex || !stream_tex) {
+    if (!mem)
+      SDL_OutOfMemory();
+    SDL_free(mem);
+    if (screen_tex)
+      SDL_DestroyTexture(screen_tex);
+    if (stream_tex)
+      SDL_DestroyTexture(stream_tex);
+    return SDL_FALSE;
+  }
+
+  if (screenTex)
+    SDL_DestroyTexture(screenTex);
+  if (streamTex)
+    SDL_DestroyTexture(streamTex);
+  screenTex = screen_tex;
+  streamTex = stream_tex;
+
+  SDL_free(arena);
+  arena = mem;
+  screen_width = cols;
+  screen_height = rows;
+  colorVerts = (SDL_Vertex *)(mem + offsets[0]);
+  glyphVerts = (SDL_Vertex *)(mem + offsets[1]);
+  quadIndices = (I *)(mem + offsets[2]);
+  framebuffer = (U32 *)(mem + offsets[3]);
+  pages = (CELL *)(mem + offsets[4]);
+  dirty_x0 = (I *)(mem + offsets[5]);
+  dirty_x1 = (I *)(mem + offsets[6]);
+  profile_row = (CELL *)(mem + offsets[7]);
+  page_rows = mem + offsets[8];
+
+  // Initialize the position of the color and glyph verts. Their colors and texture coordinates are set from the
+  // cells below, but their positions never change within a mode and are set here.
+  // The verts of each quad go top left, bottom left, bottom right, top right.
+  for (I y = 0, i = 0; y < rows; y++) {
+    for (I x = 0; x < cols; x++, i++) {
       const I W = FONT_WIDTH;
       const I H = FONT_HEIGHT;
-      colorVerts[i * 6 + 0] = (SDL_Vertex){.position = {x * W, y * H}};
-      colorVerts[i * 6 + 1] = (SDL_Vertex){.position = {x * W, y * H + H}};
-      colorVerts[i * 6 + 2] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
+      colorVerts[i * 4 + 0] = (SDL_Vertex){.position = {x * W, y * H}};
+      colorVerts[i * 4 + 1] = (SDL_Vertex){.position = {x * W, y * H + H}};
+      colorVerts[i * 4 + 2] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
+      colorVerts[i * 4 + 3] = (SDL_Vertex){.position = {x * W + W, y * H}};
+
+      glyphVerts[i * 4 + 0] = (SDL_Vertex){.position = {x * W, y * H}};
+      glyphVerts[i * 4 + 1] = (SDL_Vertex){.position = {x * W, y * H + H}};
+      glyphVerts[i * 4 + 2] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
+      glyphVerts[i * 4 + 3] = (SDL_Vertex){.position = {x * W + W, y * H}};
+
+      quadIndices[i * 6 + 0] = i * 4 + 0;
+      quadIndices[i * 6 + 1] = i * 4 + 1;
+      quadIndices[i * 6 + 2] = i * 4 + 2;
+      quadIndices[i * 6 + 3] = i * 4 + 0;
+      quadIndices[i * 6 + 4] = i * 4 + 2;
+      quadIndices[i * 6 + 5] = i * 4 + 3;
+    }
+  }
 
-      colorVerts[i * 6 + 3] = (SDL_Vertex){.position = {x * W, y * H}};
-      colorVerts[i * 6 + 4] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
-      colorVerts[i * 6 + 5] = (SDL_Vertex){.position = {x * W + W, y * H}};
+  // Every page starts with its rows in order and every cell zeroed, and the verts are made to match
+  for (I p = 0; p < SCREEN_PAGES; p++)
+    for (I y = 0; y < rows; y++)
+      rows_at(p)[y] = (U8)y;
+  active = page_at(active_page);
+  screen = page_at(visible_page);
+  active_rows = rows_at(active_page);
+  screen_rows = rows_at(visible_page);
+  for (I y = 0; y < rows; y++) {
+    mark_clean(y);
+    set_row_verts(0, y, cols, row_at(screen, y));
+  }
+  needs_present = SDL_TRUE;
+
+  view_top = 0;
+  view_bottom = rows - 1;
+  cursor_x = 0;
+  cursor_y = 0;
+  cursor_below_view = SDL_FALSE;
+  profile_row_y = -1;
+  camera_page = -1;
+  set_scale(scale_mode);
+  return SDL_TRUE;
+}
 
-      glyphVerts[i * 6 + 0] = (SDL_Vertex){.position = {x * W, y * H}};
-      glyphVerts[i * 6 + 1] = (SDL_Vertex){.position = {x * W, y * H + H}};
-      glyphVerts[i * 6 + 2] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
+//==================================================init_synth====================================================
+// Get the synthesizer ready to play at audio_spec.freq
+static V init_synth() {
+  for (I i = 0; i < WAVETABLE_SIZE; i++)
+    wavetable_step[i] = wavetable[(i + 1) & WAVETABLE_MASK] - wavetable[i];
 
-      glyphVerts[i * 6 + 3] = (SDL_Vertex){.position = {x * W, y * H}};
-      glyphVerts[i * 6 + 4] = (SDL_Vertex){.position = {x * W + W, y * H + H}};
-      glyphVerts[i * 6 + 5] = (SDL_Vertex){.position = {x * W + W, y * H}};
+  song_state.octave = DEFAULT_OCTAVE;
+  // song_state.tempo = (I)((1.0 / (DEFAULT_TEMPO / 4.0 / 60.0)) * audio_spec.freq);
+  // D tmp = 100;            // 100 BMP
+  // tmp /= 60;              // 1.66667 BPS
+  // tmp = 1 / tmp;          // 0.6 seconds per beat
+  // tmp *= 4;               // 2.4 seconds per whole note
+  // tmp *= audio_spec.freq; // 26,460 samples per whole note
+  // song_state.tempo = (I)tmp;
+  // song_state.tempo = (I)(1 / ((D)DEFAULT_TEMPO / 60) * 4 * audio_spec.freq);
+  // printf("%d\n", song_state.tempo);
+  song_state.tempo = bpm_to_samples(100);
+  song_state.tempo_div = 4;
+  song_state.flow = MUSIC_NORMAL;
+  song_state.background = SDL_TRUE;
+}
+
+//==================================================quit_synth====================================================
+// Forget every song, silence every voice and reset AUDIO_STATS. audio_callback must not be running.
+static V quit_synth() {
+  drain_audio_log();
+  for (I i = 0; i < SONG_CACHE_SIZE; i++) {
+    SDL_free(song_cache[i].text);
+    SDL_free(song_cache[i].events);
+    song_cache[i] = (SONG){0};
+  }
+  SDL_free(song_scratch);
+  song_scratch = NULL;
+  song_scratch_size = 0;
+  song_last = NULL;
+  SDL_AtomicSet(&audio_queue_head, 0);
+  SDL_AtomicSet(&audio_queue_tail, 0);
+  SDL_AtomicSet(&audio_music_done, 0);
+  SDL_zeroa(voices);
+  SDL_AtomicSet(&audio_log_head, 0);
+  SDL_AtomicSet(&audio_log_tail, 0);
+  SDL_AtomicSet(&audio_log_dropped, 0);
+  SDL_AtomicSet(&audio_counters_seq, 0);
+  audio_counters = (AUDIO_COUNTERS){0};
+}
+
+//=====================================================START======================================================
+V START(const C *window_title) {
+  // The environment can force headless mode, for machines without a display
+  CC *env_headless = SDL_getenv("BASIC_HEADLESS");
+  if (env_headless)
+    headless = SDL_clamp(SDL_atoi(env_headless), HEADLESS_OFF, HEADLESS_NORENDER);
+
+  // It can also record or replay the input, for benchmarks and regression tests
+  CC *env_record = SDL_getenv("BASIC_RECORD");
+  if (env_record)
+    RECORD(env_record);
+  CC *env_replay = SDL_getenv("BASIC_REPLAY");
+  if (env_replay)
+    REPLAY(env_replay);
+  seed_random((I)time(0));
+
+  // Initialize SDL. Headless mode has no use for the video subsystem, but still needs events for input and quit.
+  if (SDL_Init((headless ? SDL_INIT_EVENTS : SDL_INIT_VIDEO) | SDL_INIT_TIMER)) {
+    SDL_LogCritical(0, "START Failed to initialize SDL: %s", SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
+
+  if (headless) {
+    // Render into a CPU framebuffer with the software renderer. There is no vsync, so UPDATE runs flat out.
+    headless_framebuffer =
+        SDL_CreateRGBSurfaceWithFormat(0, WINDOW_WIDTH, WINDOW_HEIGHT, 32, SDL_PIXELFORMAT_RGBA32);
+    if (!headless_framebuffer) {
+      SDL_LogCritical(0, "START Failed to create headless framebuffer: %s", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+
+    renderer = SDL_CreateSoftwareRenderer(headless_framebuffer);
+    if (!renderer) {
+      SDL_LogCritical(0, "START Failed to create headless renderer: %s", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    window = SDL_CreateWindow(                          //
+        window_title,                                   //
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, //
+        WINDOW_WIDTH, WINDOW_HEIGHT,                    //
+        SDL_WINDOW_RESIZABLE);                          //
+    if (!window) {
+      SDL_LogCritical(0, "START Failed to create window: %s", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+
+    // Presents wait for vsync when the display refreshes a whole number of times every frame, where that paces
+    // them evenly without tearing. Any other display is presented to as soon as a frame is done. wait_frame holds
+    // UPDATE to FRAME_RATE either way.
+    SDL_DisplayMode display;
+    const SDL_bool vsync = SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &display) == 0 &&
+                           display.refresh_rate > 0 && display.refresh_rate % FRAME_RATE == 0;
+    const U32 flags = SDL_RENDERER_TARGETTEXTURE | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+    renderer = SDL_CreateRenderer(window, -1, flags);
+    if (!renderer) {
+      SDL_LogCritical(0, "START Failed to create renderer: %s", SDL_GetError());
+      exit(EXIT_FAILURE);
     }
+
+    SDL_SetWindowMinimumSize(window, WINDOW_WIDTH, WINDOW_HEIGHT);
+  }
+
+  // Build the glyph UV table, the font is 16 glyphs wide and 16 glyphs tall
+  for (I g = 0; g < 256; g++) {
+    const float gx = (float)(g % 16) / 16;
+    const float gy = (float)(g / 16) / 16;
+    const float gw = 1.0f / 16;
+    const float gh = 1.0f / 16;
+    glyphUVs[g][0] = (SDL_FPoint){gx, gy};
+    glyphUVs[g][1] = (SDL_FPoint){gx, gy + gh};
+    glyphUVs[g][2] = (SDL_FPoint){gx + gw, gy + gh};
+    glyphUVs[g][3] = (SDL_FPoint){gx + gw, gy};
   }
 
   // Load the font
@@ -335,6 +1600,17 @@ V START(const C *window_title) {
       exit(EXIT_FAILURE);
     }
 
+    // Decode the 1-bpp glyph masks for the software renderer. Color 0 is now transparent, anything opaque is
+    // part of the glyph.
+    for (I g = 0; g < 256; g++) {
+      for (I row = 0; row < FONT_HEIGHT; row++) {
+        const U8 *p = (const U8 *)s2->pixels + (g / 16 * FONT_HEIGHT + row) * s2->pitch + g % 16 * FONT_WIDTH * 4;
+        for (I px = 0; px < FONT_WIDTH; px++)
+          if (p[px * 4 + 3])
+            glyph_masks[g][row] |= 1 << px;
+      }
+    }
+
     fontTex = SDL_CreateTextureFromSurface(renderer, s2);
     SDL_FreeSurface(s2);
     if (!fontTex) {
@@ -343,95 +1619,68 @@ V START(const C *window_title) {
     }
   }
 
-  // Create the screen textures
-  screenTex = SDL_CreateTexture(    //
-      renderer,                     //
-      SDL_PIXELFORMAT_RGBA32,       //
-      SDL_TEXTUREACCESS_TARGET,     //
-      FONT_WIDTH * SCREEN_WIDTH,    //
-      FONT_HEIGHT * SCREEN_HEIGHT); //
-  if (!screenTex) {
-    SDL_LogCritical(0, "START Failed to create screen texture: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+  for (I i = 0; i < 16; i++) {
+    for (I px = 0; px < 4; px++)
+      glyph_expand[i][px] = i & 1 << px ? 0xFFFFFFFF : 0;
+    SDL_memcpy(&palette_rgba[i], &palette[i], sizeof(palette_rgba[i])); // SDL_Color is already in RGBA32 order
   }
 
-  {
-    // Enable filtering for the big texture
-    CC *oldQuality = SDL_GetHint(SDL_HINT_RENDER_SCALE_QUALITY);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-
-    bigScreenTex = SDL_CreateTexture(     //
-        renderer,                         //
-        SDL_PIXELFORMAT_RGBA32,           //
-        SDL_TEXTUREACCESS_TARGET,         //
-        FONT_WIDTH * SCREEN_WIDTH * 3,    //
-        FONT_HEIGHT * SCREEN_HEIGHT * 3); //
-
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, oldQuality);
-    if (!bigScreenTex) {
-      SDL_LogCritical(0, "START Failed to create big screen texture: %s", SDL_GetError());
-      exit(EXIT_FAILURE);
-    }
-  }
+  CC *env_render = SDL_getenv("BASIC_RENDER");
+  if (env_render)
+    render_mode = SDL_clamp(SDL_atoi(env_render), RENDER_GEOMETRY, RENDER_SOFTWARE);
+  CC *env_scale = SDL_getenv("BASIC_SCALE");
+  if (env_scale)
+    scale_mode = SDL_clamp(SDL_atoi(env_scale), SCALE_FILTERED, SCALE_SMOOTH);
 
-  // Reset color and clear the screen
+  // Allocate the buffers and textures of the starting text mode, then reset color and clear the screen
+  if (!set_mode(SCREEN_WIDTH, SCREEN_HEIGHT)) {
+    SDL_LogCritical(0, "START Failed to create the screen: %s", SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
   COLOR(WHITE, BLACK);
   CLS(' ');
 
-  // Create the audio device and start it playing
-  audio_device = SDL_OpenAudioDevice(               //
-      NULL, 0,                                      //
-      &(SDL_AudioSpec){.freq = 44100,               //
-                       .format = AUDIO_S16SYS,      //
-                       .channels = 1,               //
-                       .samples = 512,              //
-                       .callback = audio_callback}, //
-      &audio_spec,                                  //
-      SDL_AUDIO_ALLOW_ANY_CHANGE);                  //
+  // Create the audio device and start it playing. Headless machines often have no audio either, so in headless
+  // mode this is allowed to fail and the rest of the program carries on at the rate we asked for. Audio that
+  // AUDIO_OFFLINE set up before START is left alone, AUDIO_RENDER is the only thing that may drive it.
+  if (audio_offline)
+    return;
+  const SDL_AudioSpec want = {.freq = 44100,               //
+                              .format = AUDIO_S16SYS,      //
+                              .channels = 1,               //
+                              .samples = 512,              //
+                              .callback = audio_callback}; //
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) == 0)
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &audio_spec, SDL_AUDIO_ALLOW_ANY_CHANGE);
   if (audio_device == 0) {
-    SDL_LogCritical(0, "Failed to open audio device: %s", SDL_GetError());
-    exit(EXIT_FAILURE);
+    if (!headless) {
+      SDL_LogCritical(0, "Failed to open audio device: %s", SDL_GetError());
+      exit(EXIT_FAILURE);
+    }
+    SDL_LogInfo(0, "START Running without audio: %s", SDL_GetError());
+    audio_spec = want;
   }
   SDL_PauseAudioDevice(audio_device, 0);
-
-  song_octave = DEFAULT_OCTAVE;
-  // song_tempo = (I)((1.0 / (DEFAULT_TEMPO / 4.0 / 60.0)) * audio_spec.freq);
-  // D tmp = 100;            // 100 BMP
-  // tmp /= 60;              // 1.66667 BPS
-  // tmp = 1 / tmp;          // 0.6 seconds per beat
-  // tmp *= 4;               // 2.4 seconds per whole note
-  // tmp *= audio_spec.freq; // 26,460 samples per whole note
-  // song_tempo = (I)tmp;
-  // song_tempo = (I)(1 / ((D)DEFAULT_TEMPO / 60) * 4 * audio_spec.freq);
-  // printf("%d\n", song_tempo);
-  song_tempo = bpm_to_samples(100);
-  song_tempo_div = 4;
-  song_flow = MUSIC_NORMAL;
+  init_synth();
 }
 
 //====================================================UPDATE======================================================
 I UPDATE() {
   if (window_closed)
     return 0;
-
-  // Update the keyboard
-  {
-    SDL_PumpEvents();
-    SDL_memcpy(last_keys, keys, sizeof(keys));
-
-    I nkeys;
-    const U8 *k = SDL_GetKeyboardState(&nkeys);
-    for (I i = 0; i < nkeys; i++) {
-      if (k[i]) {
-        keys[i] = last_keys[i] + 1;
-        if (keys[i] >= TYPOMATIC_DELAY + TYPOMATIC_INTERVAL) {
-          last_keys[i] = 0;
-          keys[i] = TYPOMATIC_DELAY;
-        }
-      } else
-        keys[i] = 0;
+  profile(PROFILE_PROGRAM);
+
+  // Update the keyboard. The key events below do most of the work, here only the keys being held need typematic.
+  SDL_zeroa(keys_just);
+  SDL_zeroa(keys_up);
+  for (I i = 0; i < held_count; i++) {
+    const SCAN scan = held_keys[i];
+    if (++held_frames[scan] >= TYPOMATIC_DELAY + TYPOMATIC_INTERVAL) {
+      held_frames[scan] = TYPOMATIC_DELAY;
+      set_key(keys_just, scan, SDL_TRUE);
     }
   }
+  profile(PROFILE_KEYBOARD);
 
   // Process events
   for (SDL_Event ev; SDL_PollEvent(&ev);) {
@@ -439,43 +1688,142 @@ I UPDATE() {
     case SDL_QUIT:
       window_closed = SDL_TRUE;
       return 0;
-    case SDL_KEYDOWN:
-      I new_end = (key_buffer_end + 1) % SDL_arraysize(key_buffer);
-      if (new_end == key_buffer_start) {
-        BEEP();
-      } else {
-        key_buffer[new_end] = ev.key.keysym.sym;
-        key_buffer_end = new_end;
-      }
+    case SDL_WINDOWEVENT: // The window may have been exposed or resized, it needs presenting again
+      needs_present = SDL_TRUE;
+      break;
+    case SDL_RENDER_TARGETS_RESET: // The contents of screenTex have been lost, redraw everything
+    case SDL_RENDER_DEVICE_RESET:
+      for (I y = 0; y < screen_height; y++)
+        mark_dirty(y, 0, screen_width);
+      break;
+    case SDL_KEYDOWN: // A replay ignores the real keyboard
+    case SDL_KEYUP:
+      if (!replay_events)
+        key_event((INPUT_EVENT){.frame = (U32)timer,
+                                .type = ev.type == SDL_KEYDOWN ? INPUT_KEYDOWN : INPUT_KEYUP,
+                                .repeat = ev.key.repeat,
+                                .scan = (U16)ev.key.keysym.scancode,
+                                .value = ev.key.keysym.sym});
       break;
     }
   }
 
+  // Feed in this frame's recorded key events, and end the program where the recording ended
+  if (replay_events) {
+    for (; replay_key < replay_count && replay_events[replay_key].frame <= (U32)timer; replay_key++) {
+      const INPUT_EVENT e = replay_events[replay_key];
+      if (e.type == INPUT_KEYDOWN || e.type == INPUT_KEYUP)
+        key_event(e);
+      if (e.type == INPUT_END) {
+        window_closed = SDL_TRUE;
+        return 0;
+      }
+    }
+  }
+
+  drain_audio_log();
+  profile(PROFILE_EVENTS);
+
   // Increment the timer and fire any timer callbacks
   timer++;
+  fire_timers();
+  profile(PROFILE_TIMERS);
+
+  if (profile_flags & PROFILE_OVERLAY_BIT)
+    draw_overlay();
+
+  // Render only the dirty spans of the screen, the rest is kept from earlier frames
+  redrawn = 0;
+  if (dirty) {
+    if (headless == HEADLESS_NORENDER) {
+      for (I y = 0; y < screen_height; y++) {
+        redrawn += SDL_max(dirty_x1[y] - dirty_x0[y], 0);
+        mark_clean(y);
+      }
+    } else if (render_mode == RENDER_SOFTWARE) {
+      redrawn = render_software();
+    } else {
+      redrawn = render_geometry();
+    }
 
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-  SDL_RenderClear(renderer);
-
-  SDL_SetRenderTarget(renderer, screenTex);
-  SDL_RenderGeometry(renderer, NULL, colorVerts, SCREEN_WIDTH * SCREEN_HEIGHT * 6, NULL, 0);
-  SDL_RenderGeometry(renderer, fontTex, glyphVerts, SCREEN_WIDTH * SCREEN_HEIGHT * 6, NULL, 0);
+    dirty = SDL_FALSE;
+    needs_present = headless != HEADLESS_NORENDER;
+  }
+  profile(PROFILE_RENDER);
+
+  if (needs_present) {
+    I w, h;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+    const SDL_Rect area = scale_rect(w, h);
+    SDL_Texture *tex = render_mode == RENDER_SOFTWARE ? streamTex : screenTex;
+
+    // Straight to the window in one pass, unless smoothing. Then the big texture gets the rows in screen order at
+    // 3x nearest first, and that is filtered down to the window.
+    if (bigScreenTex) {
+      SDL_SetRenderTarget(renderer, bigScreenTex);
+      copy_rows(tex, (SDL_Rect){0, 0, FONT_WIDTH * screen_width * 3, FONT_HEIGHT * screen_height * 3});
+    }
 
-  SDL_SetRenderTarget(renderer, bigScreenTex);
-  SDL_RenderCopy(renderer, screenTex, NULL, NULL);
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    if (bigScreenTex)
+      SDL_RenderCopy(renderer, bigScreenTex, NULL, &area);
+    else
+      copy_rows(tex, area);
+    profile(PROFILE_COPY);
+
+    SDL_RenderPresent(renderer);
+    needs_present = SDL_FALSE;
+    profile(PROFILE_PRESENT);
+  }
 
-  SDL_SetRenderTarget(renderer, NULL);
-  SDL_RenderCopy(renderer, bigScreenTex, NULL, NULL);
+  // Headless programs and replays run as fast as they can
+  if (!headless && !replay_events)
+    wait_frame();
+  profile(PROFILE_WAIT);
 
-  SDL_RenderPresent(renderer);
+  if (profile_flags)
+    profile_frame();
+  profile_sets = 0;
   return 1;
 }
 
 //======================================================END=======================================================
 V END() {
+  if (record_file) {
+    record_input((INPUT_EVENT){.frame = (U32)timer, .type = INPUT_END});
+    if (record_file && SDL_RWclose(record_file) != 0)
+      SDL_LogError(0, "END Failed to write the recording: %s", SDL_GetError());
+    record_file = NULL;
+  }
+  if (replay_events) {
+    SDL_LogInfo(0, "END Replay finished after %d frames, screen hash %08x", timer, SCREEN_HASH());
+    SDL_free(replay_events);
+    replay_events = NULL;
+    replay_count = replay_key = replay_seed = 0;
+  }
+
+  if (profile_csv)
+    write_profile();
+  SDL_free(profile_csv);
+  SDL_free(profile_log);
+  profile_csv = NULL;
+  profile_log = NULL;
+  profile_log_size = 0;
+  profile_frames = 0;
+  profile_flags = 0;
+
   fontTex = NULL;
   screenTex = NULL;
   bigScreenTex = NULL;
+  streamTex = NULL;
+  SDL_free(arena);
+  arena = NULL;
+  SDL_free(world);
+  world = NULL;
+  world_w = world_h = world_tiles = 0;
+  camera_page = -1;
 
   if (renderer) {
     SDL_DestroyRenderer(renderer);
@@ -487,18 +1835,199 @@ V END() {
     window = NULL;
   }
 
-  SDL_QuitSubSystem(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER);
+  if (headless_framebuffer) {
+    SDL_FreeSurface(headless_framebuffer);
+    headless_framebuffer = NULL;
+  }
+
+  if (audio_device) {
+    SDL_CloseAudioDevice(audio_device);
+    audio_device = 0;
+  }
+  audio_offline = SDL_FALSE;
+  frame_epoch = 0;
+  frame_count = 0;
+
+  SDL_free(timers);
+  timers = NULL;
+  timers_size = 0;
+  timers_free = 0;
+  timers_on = SDL_FALSE;
+  SDL_zeroa(timer_wheel);
+  quit_synth();
+
+  SDL_QuitSubSystem(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_AUDIO | SDL_INIT_TIMER);
+}
+
+//==================================================AUDIO_BUSY====================================================
+I AUDIO_BUSY() {
+  if (!audio_offline)
+    return 0;
+  if (SDL_AtomicGet(&audio_queue_head) != SDL_AtomicGet(&audio_queue_tail))
+    return 1;
+  for (I i = 0; i < AUDIO_VOICES; i++)
+    if (voices[i].events)
+      return 1;
+  return 0;
+}
+
+//=================================================AUDIO_OFFLINE==================================================
+V AUDIO_OFFLINE(I freq) {
+  if (freq <= 0) {
+    SDL_LogError(0, "AUDIO_OFFLINE: Invalid frequency %d", freq);
+    return;
+  }
+
+  // Nothing else may call audio_callback from here on, so the device goes first
+  if (audio_device) {
+    SDL_CloseAudioDevice(audio_device);
+    audio_device = 0;
+  }
+  quit_synth();
+
+  audio_spec = (SDL_AudioSpec){.freq = freq, .format = AUDIO_S16SYS, .channels = 1, .samples = 512};
+  audio_offline = SDL_TRUE;
+  init_synth();
+}
+
+//=================================================AUDIO_RENDER===================================================
+V AUDIO_RENDER(I len, I16 buf[len]) {
+  if (!audio_offline) {
+    SDL_LogError(0, "AUDIO_RENDER needs AUDIO_OFFLINE first");
+    SDL_memset(buf, 0, len * sizeof(*buf));
+    return;
+  }
+  audio_callback(NULL, (U8 *)buf, len * (I)sizeof(*buf));
+}
+
+//==================================================AUDIO_STATS===================================================
+AUDIO_HEALTH AUDIO_STATS() {
+  // Copy the counters until the copy is from between two of audio_callback's updates
+  AUDIO_COUNTERS c = {0};
+  for (I seq = -1; seq & 1 || seq != SDL_AtomicGet(&audio_counters_seq);) {
+    seq = SDL_AtomicGet(&audio_counters_seq);
+    SDL_MemoryBarrierAcquire();
+    c = audio_counters;
+    SDL_MemoryBarrierAcquire();
+  }
+
+  const D ms = 1000.0 / (D)SDL_GetPerformanceFrequency();
+  return (AUDIO_HEALTH){.callbacks = (I)c.callbacks,
+                        .avg_ms = c.callbacks ? (D)c.ticks / (D)c.callbacks * ms : 0.0,
+                        .max_ms = (D)c.max_ticks * ms,
+                        .late = (I)c.late,
+                        .dropped = SDL_AtomicGet(&audio_log_dropped)};
+}
+
+//===================================================AUDIO_WAV====================================================
+I AUDIO_WAV(const C *path, I len, const I16 buf[len]) {
+  SDL_RWops *file = SDL_RWFromFile(path, "wb");
+  if (!file) {
+    SDL_LogError(0, "AUDIO_WAV Failed to open %s: %s", path, SDL_GetError());
+    return 0;
+  }
+
+  // A canonical 44 byte header for mono 16-bit PCM, everything little endian
+  const U32 rate = (U32)audio_spec.freq;
+  const U32 data = (U32)len * 2;
+  U8 header[44] = "RIFF....WAVEfmt ....\1\0\1\0........\2\0\20\0data....";
+  const U32 fields[][2] = {{4, 36 + data}, {16, 16}, {24, rate}, {28, rate * 2}, {40, data}};
+  for (I i = 0; i < (I)SDL_arraysize(fields); i++)
+    for (I b = 0; b < 4; b++)
+      header[fields[i][0] + b] = (U8)(fields[i][1] >> (8 * b));
+  SDL_bool ok = SDL_RWwrite(file, header, sizeof(header), 1) == 1;
+
+  // Samples are written in blocks, byte swapped on big endian machines
+  I16 block[1024];
+  for (I i = 0; ok && i < len; i += (I)SDL_arraysize(block)) {
+    const I n = SDL_min((I)SDL_arraysize(block), len - i);
+    for (I j = 0; j < n; j++)
+      block[j] = (I16)SDL_SwapLE16((U16)buf[i + j]);
+    ok = SDL_RWwrite(file, block, sizeof(*block), (size_t)n) == (size_t)n;
+  }
+
+  if (SDL_RWclose(file) != 0 || !ok) {
+    SDL_LogError(0, "AUDIO_WAV Failed to write %s: %s", path, SDL_GetError());
+    return 0;
+  }
+  return 1;
 }
 
 //=====================================================BEEP=======================================================
 V BEEP() { SOUND(400, 0.2); }
 
+//======================================================BOX=======================================================
+V BOX(I x, I y, I w, I h, I style) {
+  // CP437 line glyphs: top left, top right, bottom left, bottom right, horizontal and vertical
+  static const U8 glyphs[][6] = {
+      [BOX_SINGLE] = {0xDA, 0xBF, 0xC0, 0xD9, 0xC4, 0xB3},
+      [BOX_DOUBLE] = {0xC9, 0xBB, 0xC8, 0xBC, 0xCD, 0xBA},
+  };
+  if (style < BOX_SINGLE || style > BOX_DOUBLE) {
+    SDL_LogError(0, "BOX: Invalid style %d", style);
+    return;
+  }
+  if (w < 2 || h < 2)
+    return;
+
+  // The top and bottom are clipped to the screen and drawn a row at a time, the sides a cell at a time
+  const U8 *g = glyphs[style];
+  const I x0 = SDL_max(x, 0), x1 = SDL_min(x + w, screen_width);
+  CELL row[SCREEN_MAX_WIDTH];
+  for (I edge = 0; edge < 2; edge++) {
+    for (I i = x0; i < x1; i++) {
+      const U8 glyph = i == x ? g[edge * 2] : i == x + w - 1 ? g[edge * 2 + 1] : g[4];
+      row[i - x0] = (CELL){.fg = cursor_fg, .bg = cursor_bg, .glyph = (C)glyph};
+    }
+    put_row(x0, edge ? y + h - 1 : y, x1 - x0, row);
+  }
+
+  const CELL side = {.fg = cursor_fg, .bg = cursor_bg, .glyph = (C)g[5]};
+  for (I r = SDL_max(y + 1, 0); r < SDL_min(y + h - 1, screen_height); r++) {
+    put_row(x, r, 1, &side);
+    put_row(x + w - 1, r, 1, &side);
+  }
+}
+
+//====================================================CAMERA======================================================
+V CAMERA(I x, I y) {
+  if (!world) {
+    SDL_LogError(0, "CAMERA: There is no WORLD");
+    return;
+  }
+
+  // Moving straight up or down keeps the rows still on screen, they're rotated into place and only the rows
+  // coming into view are drawn. Any other move, or a page the camera didn't draw last or that has been drawn on
+  // since, is diffed row by row.
+  const I dy = y - camera_y;
+  const SDL_bool reuse = camera_page == active_page && camera_rows && x == camera_x && SDL_abs(dy) < screen_height;
+  camera_x = x;
+  camera_y = y;
+  camera_page = active_page;
+  camera_rows = SDL_TRUE;
+  if (reuse) {
+    if (dy == 0)
+      return;
+    const I first = rotate_rows(active_page, 0, screen_height - 1, dy);
+    for (I r = first; r < first + SDL_abs(dy); r++)
+      camera_row(r);
+  } else {
+    for (I r = 0; r < screen_height; r++)
+      camera_row(r);
+  }
+}
+
 //======================================================CLS=======================================================
 V CLS(I c) {
-  CELL cell = {cursor_fg, cursor_bg, c};
-  for (I y = 0; y < SCREEN_HEIGHT; y++)
-    for (I x = 0; x < SCREEN_WIDTH; x++)
-      SET(x, y, cell);
+  // Every cell is about to be set anyway, so this is a good time to put the rows back in order
+  if (active_page == camera_page)
+    camera_page = -1;
+  for (I y = 0; y < screen_height; y++)
+    active_rows[y] = (U8)y;
+  if (active == screen)
+    needs_present = SDL_TRUE;
+
+  FILL(0, 0, screen_width, screen_height, (CELL){cursor_fg, cursor_bg, c});
 }
 
 //=====================================================COLOR======================================================
@@ -507,8 +2036,39 @@ V COLOR(I fg, I bg) {
   cursor_bg = bg & 0xF;
 }
 
+//=====================================================FILL=======================================================
+V FILL(I x, I y, I w, I h, CELL c) {
+  // One row of the cells is made, clipped to the screen, and put on every row
+  const I x0 = SDL_max(x, 0), x1 = SDL_min(x + w, screen_width);
+  if (x0 >= x1)
+    return;
+  CELL row[SCREEN_MAX_WIDTH];
+  for (I i = 0; i < x1 - x0; i++)
+    row[i] = c;
+  for (I r = SDL_max(y, 0); r < SDL_min(y + h, screen_height); r++)
+    put_row(x0, r, x1 - x0, row);
+}
+
 //======================================================GET=======================================================
-CELL GET(I x, I y) { return screen[y][x]; }
+CELL GET(I x, I y) {
+  // The text mode may be smaller than SCREEN_WIDTH by SCREEN_HEIGHT, so the screen's edges are checked
+  if (x < 0 || x >= screen_width || y < 0 || y >= screen_height)
+    return (CELL){0};
+  return row_at(active, active_rows[y])[x];
+}
+
+//====================================================GETRECT=====================================================
+V GETRECT(I x, I y, I w, I h, CELL buf[w * h]) {
+  // Only the cells on the screen are copied, the rest of buf is left as it was
+  const I x0 = SDL_max(x, 0), x1 = SDL_min(x + w, screen_width);
+  if (x0 >= x1)
+    return;
+  for (I r = SDL_max(y, 0); r < SDL_min(y + h, screen_height); r++)
+    SDL_memcpy(&buf[(r - y) * w + x0 - x], &row_at(active, active_rows[r])[x0], (x1 - x0) * sizeof(CELL));
+}
+
+//===================================================HEADLESS=====================================================
+V HEADLESS(I mode) { headless = SDL_clamp(mode, HEADLESS_OFF, HEADLESS_NORENDER); }
 
 //=====================================================INKEY======================================================
 KEY INKEY() {
@@ -523,55 +2083,97 @@ KEY INKEY() {
 V INPUT(I size, C buf[size]) { SDL_LogInfo(0, "INPUT not implemented"); }
 
 //=====================================================ISKEY======================================================
-I ISKEY(KEY k) {
-  SDL_Scancode scan = SDL_GetScancodeFromKey(k);
-  return keys[scan];
-}
+I ISKEY(KEY k) { return ISSCAN(SDL_GetScancodeFromKey(k)); }
 
 //===================================================ISKEYJUST====================================================
-I ISKEYJUST(KEY k) {
-  SDL_Scancode scan = SDL_GetScancodeFromKey(k);
-  return keys[scan] && !last_keys[scan];
-}
+I ISKEYJUST(KEY k) { return ISSCANJUST(SDL_GetScancodeFromKey(k)); }
 
 //====================================================ISNOKEY=====================================================
-I ISNOKEY(KEY k) {
-  SDL_Scancode scan = SDL_GetScancodeFromKey(k);
-  return !keys[scan];
-}
+I ISNOKEY(KEY k) { return ISNOSCAN(SDL_GetScancodeFromKey(k)); }
 
 //==================================================ISNOKEYJUST===================================================
-I ISNOKEYJUST(KEY k) {
-  SDL_Scancode scan = SDL_GetScancodeFromKey(k);
-  return !keys[scan] && last_keys[scan];
-}
+I ISNOKEYJUST(KEY k) { return ISNOSCANJUST(SDL_GetScancodeFromKey(k)); }
+
+//===================================================ISNOSCAN=====================================================
+I ISNOSCAN(SCAN s) { return !get_key(keys_down, s); }
+
+//=================================================ISNOSCANJUST===================================================
+I ISNOSCANJUST(SCAN s) { return get_key(keys_up, s); }
+
+//====================================================ISSCAN======================================================
+I ISSCAN(SCAN s) { return get_key(keys_down, s); }
+
+//==================================================ISSCANJUST====================================================
+I ISSCANJUST(SCAN s) { return get_key(keys_just, s); }
 
 //====================================================LOCATE======================================================
 V LOCATE(I x, I y) {
   if (x < 0) {
-    y -= (x - SCREEN_WIDTH) / SCREEN_WIDTH;
-    x += (x - SCREEN_WIDTH) / SCREEN_WIDTH * SCREEN_WIDTH;
+    y -= (x - screen_width) / screen_width;
+    x += (x - screen_width) / screen_width * screen_width;
   }
-  if (x >= SCREEN_WIDTH) {
-    y += x / SCREEN_WIDTH;
-    x -= x / SCREEN_WIDTH * SCREEN_WIDTH;
+  if (x >= screen_width) {
+    y += x / screen_width;
+    x -= x / screen_width * screen_width;
   }
   if (y < 0)
     y = 0;
-  if (y >= SCREEN_HEIGHT)
-    y = SCREEN_HEIGHT;
+  if (y >= screen_height)
+    y = screen_height;
 
   cursor_x = x;
   cursor_y = y;
+  cursor_below_view = SDL_FALSE;
 }
 
 //===================================================LOCATEREL====================================================
 V LOCATEREL(I x, I y) { LOCATE(cursor_x + x, cursor_y + y); }
 
+//=====================================================PCOPY======================================================
+V PCOPY(I src, I dst) {
+  if (src < 0 || src >= SCREEN_PAGES || dst < 0 || dst >= SCREEN_PAGES) {
+    SDL_LogError(0, "PCOPY: Invalid page %d or %d", src, dst);
+    return;
+  }
+
+  if (dst == visible_page) {
+    show_page(page_at(src));
+    needs_present = SDL_TRUE;
+  }
+  SDL_memcpy(page_at(dst), page_at(src), (Z)screen_width * screen_height * sizeof(CELL));
+  if (dst == camera_page)
+    camera_page = -1;
+  SDL_memcpy(rows_at(dst), rows_at(src), screen_height);
+}
+
 //=====================================================PLAY=======================================================
-V PLAY(const C *song_) {
-  song = song_;
-  song_note_duration = 0; // End current note early
+I PLAY(const C *text) {
+  // Songs are compiled here rather than on the audio thread, so errors are reported right away
+  SONG *song = compile_song(text);
+  if (!song)
+    return 0;
+  song->used = ++song_clock;
+
+  const AUDIO_COMMAND cmd = {.type = AUDIO_PLAY, .events = song->events, .count = song->count};
+  U32 pos;
+  if (!audio_enqueue(&cmd, &pos))
+    return 0;
+
+  if (song_last && song_last != song) {
+    song_last->replaced = SDL_TRUE;
+    song_last->replaced_by = pos;
+  }
+  song->queued = SDL_TRUE;
+  song->replaced = SDL_FALSE;
+  song->sent = pos;
+  song_last = song;
+
+  // Music in the foreground holds up the program until it's done, like QBasic. Offline nothing plays until
+  // AUDIO_RENDER, so there is nothing to wait for.
+  if (!song->end.background && !audio_offline)
+    while ((I32)((U32)SDL_AtomicGet(&audio_music_done) - (pos + 1)) < 0)
+      SDL_Delay(1);
+  return 1;
 }
 
 //===================================================PLAY_OFF=====================================================
@@ -596,80 +2198,340 @@ V POS(I *x, I *y) {
 
 //=====================================================PRINT======================================================
 V PRINT(const C *format, ...) {
-  static char buffer[SCREEN_WIDTH * SCREEN_HEIGHT + 1];
+  // Without a conversion there is nothing for vsnprintf to do
+  if (!SDL_strchr(format, '%')) {
+    print_text(format, SDL_MAX_SINT32);
+    return;
+  }
+
+  static char buffer[SCREEN_MAX_WIDTH * SCREEN_MAX_HEIGHT + 1];
 
   va_list args;
   va_start(args, format);
-  vsnprintf(buffer, sizeof(buffer), format, args);
+  const I len = vsnprintf(buffer, sizeof(buffer), format, args);
   va_end(args);
-
-  for (I i = 0; buffer[i]; i++) {
-    switch (buffer[i]) {
-    case '\a':
-      BEEP();
-      break;
-    case '\b':
-      LOCATEREL(-1, 0);
-      break;
-    case '\n':
-      LOCATE(1, cursor_y + 2);
-      break;
-    case '\r':
-      LOCATE(0, cursor_y);
-      break;
-    case '\t':
-      LOCATE(cursor_x / 8 + 8, cursor_y);
-      break;
-    default:
-      SET(cursor_x, cursor_y, (CELL){.fg = cursor_fg, .bg = cursor_bg, .glyph = buffer[i]});
-      LOCATEREL(1, 0);
-      break;
-    }
-  }
+  print_text(buffer, SDL_min(len, (I)sizeof(buffer) - 1));
 }
 
+//====================================================PRINTN======================================================
+V PRINTN(const C *text, I n) { print_text(text, n); }
+
 //===================================================PRINTRAW=====================================================
 V PRINTRAW(const C *format, ...) {
-  static char buffer[SCREEN_WIDTH * SCREEN_HEIGHT + 1];
+  if (!SDL_strchr(format, '%')) {
+    write_run(format, (I)SDL_strlen(format));
+    return;
+  }
+
+  static char buffer[SCREEN_MAX_WIDTH * SCREEN_MAX_HEIGHT + 1];
 
   va_list args;
   va_start(args, format);
-  vsnprintf(buffer, sizeof(buffer), format, args);
+  const I len = vsnprintf(buffer, sizeof(buffer), format, args);
   va_end(args);
+  write_run(buffer, SDL_clamp(len, 0, (I)sizeof(buffer) - 1));
+}
+
+//===================================================PRINTRAWN====================================================
+V PRINTRAWN(const C *text, I n) {
+  I len = 0;
+  while (len < n && text[len])
+    len++;
+  write_run(text, len);
+}
 
-  for (I i = 0; buffer[i]; i++) {
-    SET(cursor_x, cursor_y, (CELL){.fg = cursor_fg, .bg = cursor_bg, .glyph = buffer[i]});
-    LOCATEREL(1, 0);
+//====================================================PRINTS======================================================
+V PRINTS(const C *text) { print_text(text, SDL_MAX_SINT32); }
+
+//====================================================PROFILE=====================================================
+V PROFILE(I flags, CC *csv) {
+  // Put back the bottom row the overlay was covering
+  if ((profile_flags & PROFILE_OVERLAY_BIT) && !(flags & PROFILE_OVERLAY_BIT) && profile_row_y >= 0) {
+    set_row_verts(0, profile_row_y, screen_width, row_at(screen, profile_row_y));
+    profile_row_y = -1;
   }
+
+  // Turning profiling off keeps what was logged for the CSV, anything else starts a new profile
+  profile_flags = flags;
+  if (!flags)
+    return;
+
+  SDL_free(profile_csv);
+  profile_csv = csv ? SDL_strdup(csv) : NULL;
+  profile_frames = 0;
+  SDL_zeroa(profile_ticks);
+  profile_last = SDL_GetPerformanceCounter();
+}
+
+//==================================================PROFILE_GET===================================================
+TIMING PROFILE_GET(I phase) {
+  const I n = SDL_min(profile_frames, PROFILE_FRAMES);
+  if (phase < 0 || phase >= PROFILE_PHASES || n == 0)
+    return (TIMING){0};
+
+  // Sorting a copy of the window is plenty fast for a few hundred frames, and costs nothing until asked
+  float sorted[PROFILE_FRAMES];
+  for (I i = 0; i < n; i++)
+    sorted[i] = profile_ring[i][phase];
+  SDL_qsort(sorted, n, sizeof(*sorted), compare_floats);
+
+  return (TIMING){.last = profile_ring[(profile_frames - 1) % PROFILE_FRAMES][phase],
+                  .p50 = sorted[(n - 1) / 2],
+                  .p99 = sorted[(n - 1) * 99 / 100],
+                  .max = sorted[n - 1]};
+}
+
+//====================================================PUTRECT=====================================================
+V PUTRECT(I x, I y, I w, I h, const CELL buf[w * h]) {
+  for (I r = SDL_max(y, 0); r < SDL_min(y + h, screen_height); r++)
+    put_row(x, r, w, &buf[(r - y) * w]);
 }
 
 //====================================================RANDOM======================================================
-I RANDOM(I min, I max) { return rand() % (max - min) + min; }
+I RANDOM(I min, I max) { return RNG_RANGE(&random_rng, min, max); }
 
 //===================================================RANDOMIZE====================================================
-V RANDOMIZE(I n) { return srand(n); }
+V RANDOMIZE(I n) { seed_random(n); }
 
-//======================================================SET=======================================================
-V SET(I x, I y, CELL c) {
-  screen[y][x] = c;
+//====================================================RECORD======================================================
+V RECORD(CC *path) {
+  if (record_file)
+    SDL_RWclose(record_file);
+
+  record_file = SDL_RWFromFile(path, "wb");
+  if (!record_file) {
+    SDL_LogError(0, "RECORD Failed to open %s: %s", path, SDL_GetError());
+    return;
+  }
 
-  I idx = (y * SCREEN_WIDTH + x) * 6;
-  for (I i = 0; i < 6; i++) {
-    colorVerts[idx + i].color = palette[c.bg];
-    glyphVerts[idx + i].color = palette[c.fg];
+  U8 header[12] = INPUT_MAGIC;
+  for (I i = 0; i < 4; i++)
+    header[8 + i] = (U8)(INPUT_VERSION >> (8 * i));
+  if (SDL_RWwrite(record_file, header, sizeof(header), 1) != 1) {
+    SDL_LogError(0, "RECORD Failed to write %s: %s", path, SDL_GetError());
+    SDL_RWclose(record_file);
+    record_file = NULL;
   }
+}
 
-  const float gx = (float)(c.glyph % 16 * FONT_WIDTH) / (FONT_WIDTH * 16);
-  const float gy = (float)(c.glyph / 16 * FONT_HEIGHT) / (FONT_HEIGHT * 16);
-  const float gw = 1.0f / 16;
-  const float gh = 1.0f / 16;
+//====================================================REDRAWN=====================================================
+I REDRAWN() { return redrawn; }
 
-  glyphVerts[idx + 0].tex_coord = (SDL_FPoint){gx, gy};
-  glyphVerts[idx + 1].tex_coord = (SDL_FPoint){gx, gy + gh};
-  glyphVerts[idx + 2].tex_coord = (SDL_FPoint){gx + gw, gy + gh};
-  glyphVerts[idx + 3].tex_coord = (SDL_FPoint){gx, gy};
-  glyphVerts[idx + 4].tex_coord = (SDL_FPoint){gx + gw, gy + gh};
-  glyphVerts[idx + 5].tex_coord = (SDL_FPoint){gx + gw, gy};
+//==================================================RENDER_MODE===================================================
+V RENDER_MODE(I mode) {
+  // Before START there is no screen to redraw yet, START draws all of it in the mode
+  render_mode = SDL_clamp(mode, RENDER_GEOMETRY, RENDER_SOFTWARE);
+  if (!screenTex)
+    return;
+
+  // The other renderer's output is stale, so everything needs drawing again
+  for (I y = 0; y < screen_height; y++)
+    mark_dirty(y, 0, screen_width);
+}
+
+//====================================================REPLAY======================================================
+V REPLAY(CC *path) {
+  Z size;
+  U8 *data = SDL_LoadFile(path, &size);
+  if (!data) {
+    SDL_LogError(0, "REPLAY Failed to read %s: %s", path, SDL_GetError());
+    return;
+  }
+
+  const SDL_bool valid = size >= 12 && (size - 12) % INPUT_EVENT_SIZE == 0 && !SDL_memcmp(data, INPUT_MAGIC, 8) &&
+                         (data[8] | data[9] << 8 | data[10] << 16 | (U32)data[11] << 24) == INPUT_VERSION;
+  if (!valid) {
+    SDL_LogError(0, "REPLAY %s is not a recording made by this version of RECORD", path);
+    SDL_free(data);
+    return;
+  }
+
+  // Anything already being replayed carries on if there's no room for this one
+  const I count = (I)((size - 12) / INPUT_EVENT_SIZE);
+  INPUT_EVENT *events = SDL_malloc(SDL_max(count, 1) * sizeof(*events));
+  if (!events) {
+    SDL_LogError(0, "REPLAY Out of memory");
+    SDL_free(data);
+    return;
+  }
+
+  SDL_free(replay_events);
+  replay_events = events;
+  replay_count = count;
+  replay_key = replay_seed = 0;
+
+  for (I i = 0; i < replay_count; i++) {
+    const U8 *b = &data[12 + i * INPUT_EVENT_SIZE];
+    replay_events[i] = (INPUT_EVENT){.frame = b[0] | b[1] << 8 | b[2] << 16 | (U32)b[3] << 24,
+                                     .type = b[4],
+                                     .repeat = b[5],
+                                     .scan = (U16)(b[6] | b[7] << 8),
+                                     .value = (I32)(b[8] | b[9] << 8 | b[10] << 16 | (U32)b[11] << 24)};
+  }
+  SDL_free(data);
+}
+
+//===================================================RNG_FILL=====================================================
+V RNG_FILL(RNG *r, I n, U32 out[n]) {
+  // Each step of the LCG depends on the last, which holds a plain loop to one multiply's latency per number. Four
+  // lanes that each jump 4 steps at a time have no dependency on each other, and give exactly the same numbers.
+  U64 mul4 = 1, add4 = 0;
+  for (I i = 0; i < 4; i++) {
+    add4 = add4 * PCG_MULTIPLIER + r->inc;
+    mul4 *= PCG_MULTIPLIER;
+  }
+  U64 s0 = r->state;
+  U64 s1 = s0 * PCG_MULTIPLIER + r->inc;
+  U64 s2 = s1 * PCG_MULTIPLIER + r->inc;
+  U64 s3 = s2 * PCG_MULTIPLIER + r->inc;
+
+  I i = 0;
+  for (; i + 4 <= n; i += 4) {
+    out[i + 0] = pcg_output(s0);
+    out[i + 1] = pcg_output(s1);
+    out[i + 2] = pcg_output(s2);
+    out[i + 3] = pcg_output(s3);
+    s0 = s0 * mul4 + add4;
+    s1 = s1 * mul4 + add4;
+    s2 = s2 * mul4 + add4;
+    s3 = s3 * mul4 + add4;
+  }
+  r->state = s0;
+
+  for (; i < n; i++)
+    out[i] = RNG_NEXT(r);
+}
+
+//===================================================RNG_NEXT=====================================================
+U32 RNG_NEXT(RNG *r) {
+  const U64 state = r->state;
+  r->state = state * PCG_MULTIPLIER + r->inc;
+  return pcg_output(state);
+}
+
+//===================================================RNG_RANGE====================================================
+I RNG_RANGE(RNG *r, I min, I max) {
+  if (min > max) {
+    const I t = min;
+    min = max;
+    max = t;
+  }
+
+  // Lemire's nearly divisionless method. Scaling a 32 bit number up to the range is only biased for the few
+  // numbers whose low half lands under 2^32 % range, and those are thrown away and drawn again.
+  const U32 range = (U32)max - (U32)min + 1;
+  if (range == 0)
+    return (I)RNG_NEXT(r);
+
+  U64 m = (U64)RNG_NEXT(r) * range;
+  if ((U32)m < range) {
+    const U32 threshold = -range % range;
+    while ((U32)m < threshold)
+      m = (U64)RNG_NEXT(r) * range;
+  }
+  return (I)((U32)min + (U32)(m >> 32));
+}
+
+//===================================================RNG_SEED=====================================================
+V RNG_SEED(RNG *r, U64 seed, I id) {
+  // The increment picks the stream and must be odd, the state then mixes in the seed as in the reference PCG32
+  r->state = 0;
+  r->inc = (U64)(U32)id << 1 | 1;
+  RNG_NEXT(r);
+  r->state += seed;
+  RNG_NEXT(r);
+}
+
+//=====================================================SCALE======================================================
+V SCALE(I mode) {
+  // Before START there are no textures yet, START sets them up for the mode
+  mode = SDL_clamp(mode, SCALE_FILTERED, SCALE_SMOOTH);
+  if (!screenTex) {
+    scale_mode = mode;
+    return;
+  }
+  set_scale(mode);
+  needs_present = SDL_TRUE;
+}
+
+//====================================================SCREEN======================================================
+V SCREEN(I apage, I vpage) {
+  if (apage < 0 || apage >= SCREEN_PAGES || vpage < 0 || vpage >= SCREEN_PAGES) {
+    SDL_LogError(0, "SCREEN: Invalid page %d or %d", apage, vpage);
+    return;
+  }
+
+  if (vpage != visible_page) {
+    show_page(page_at(vpage));
+    visible_page = vpage;
+    screen = page_at(vpage);
+    screen_rows = rows_at(vpage);
+    needs_present = SDL_TRUE;
+  }
+  active_page = apage;
+  active = page_at(apage);
+  active_rows = rows_at(apage);
+}
+
+//==================================================SCREEN_HASH===================================================
+U32 SCREEN_HASH() {
+  // FNV-1a over the colors and glyph of every cell on the visible page
+  U32 hash = 2166136261u;
+  for (I y = 0; y < screen_height; y++) {
+    for (I x = 0; x < screen_width; x++) {
+      const CELL c = row_at(screen, screen_rows[y])[x];
+      hash = (hash ^ (U8)(c.fg | c.bg << 4)) * 16777619u;
+      hash = (hash ^ (U8)c.glyph) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+//==================================================SCREEN_SIZE===================================================
+V SCREEN_SIZE(I *cols, I *rows) {
+  if (cols)
+    *cols = screen_width;
+  if (rows)
+    *rows = screen_height;
+}
+
+//====================================================SCROLL======================================================
+V SCROLL(I x, I y, I w, I h, I n) {
+  const I x0 = SDL_max(x, 0), x1 = SDL_min(x + w, screen_width);
+  const I y0 = SDL_max(y, 0), y1 = SDL_min(y + h, screen_height);
+  if (x0 >= x1 || y0 >= y1 || n == 0)
+    return;
+
+  // Whole rows are only rotated, the way PRINT scrolls
+  if (x0 == 0 && x1 == screen_width) {
+    scroll_page(active_page, y0, y1 - 1, n);
+    return;
+  }
+  if (active_page == camera_page)
+    camera_page = -1;
+
+  // Up copies each row from the one n below it, working down so that row hasn't been copied over yet. Down is
+  // the same working up. The rows scrolled in are cleared to the cursor color.
+  const I count = y1 - y0;
+  n = SDL_clamp(n, -count, count);
+  for (I i = 0; i < count - SDL_abs(n); i++) {
+    const I r = n > 0 ? y0 + i : y1 - 1 - i;
+    put_row(x0, r, x1 - x0, &row_at(active, active_rows[r + n])[x0]);
+  }
+  FILL(x0, n > 0 ? y1 - n : y0, x1 - x0, SDL_abs(n), (CELL){.fg = cursor_fg, .bg = cursor_bg, .glyph = ' '});
+}
+
+//======================================================SET=======================================================
+V SET(I x, I y, CELL c) {
+  if (x < 0 || x >= screen_width || y < 0 || y >= screen_height)
+    return;
+  profile_sets++;
+  if (active_page == camera_page)
+    camera_rows = SDL_FALSE;
+  y = active_rows[y];
+  row_at(active, y)[x] = c;
+  if (active == screen)
+    set_verts(x, y, c);
 }
 
 //===================================================SET_CHAR=====================================================
@@ -681,10 +2543,8 @@ V SET_CHAR(I x, I y, C c) {
 
 //=====================================================SOUND======================================================
 V SOUND(I freq, D dur) {
-  song = "";
-  song_note = freq;
-  song_note_duration = audio_spec.freq * dur;
-  song_sample = 0;
+  const AUDIO_COMMAND cmd = {.type = AUDIO_SOUND, .sound = {freq, (I)(audio_spec.freq * dur)}};
+  audio_enqueue(&cmd, NULL);
 }
 
 //=====================================================STICK======================================================
@@ -693,17 +2553,78 @@ I STICK(I param) {
   return 0;
 }
 
+//=====================================================TIMER======================================================
+I TIMER() { return timer; }
+
+//==================================================TIMER_KILL====================================================
+V TIMER_KILL(I id) {
+  // The entry is freed when fire_timers next comes across it. An id from a generation before the entry's is for
+  // a timer that's already gone, and the entry now belongs to another.
+  const I i = id & ((1 << TIMER_ENTRY_BITS) - 1);
+  if (id > 0 && i < timers_size && timers[i].gen == id >> TIMER_ENTRY_BITS)
+    timers[i].func = NULL;
+}
+
 //===================================================TIMER_OFF====================================================
-V TIMER_OFF() { SDL_LogInfo(0, "TIMER_OFF not implemented"); }
+V TIMER_OFF() { timers_on = SDL_FALSE; }
 
 //===================================================TIMER_ON=====================================================
-V TIMER_ON() { SDL_LogInfo(0, "TIMER_ON not implemented"); }
+V TIMER_ON() { timers_on = SDL_TRUE; }
 
 //==================================================TIMER_RESET===================================================
-V TIMER_RESET() { SDL_LogInfo(0, "TIMER_RESET not implemented"); }
+V TIMER_RESET() {
+  for (I i = 1; i < timers_size; i++)
+    timers[i].func = NULL;
+}
+
+//===================================================TIMER_SET====================================================
+I TIMER_SET(I period, V (*func)(V)) {
+  if (period <= 0 || !func) {
+    SDL_LogError(0, "TIMER_SET needs a positive period and a callback");
+    return 0;
+  }
+
+  // Take a free entry, or grow timers to make some
+  if (!timers_free) {
+    const I size = SDL_min(SDL_max(timers_size * 2, 64), 1 << TIMER_ENTRY_BITS);
+    if (size == timers_size) {
+      SDL_LogError(0, "TIMER_SET Too many timers");
+      return 0;
+    }
+    TIMER_ENTRY *grown = SDL_realloc(timers, size * sizeof(*timers));
+    if (!grown) {
+      SDL_LogError(0, "TIMER_SET Out of memory");
+      return 0;
+    }
+    timers = grown;
+    for (I i = size - 1; i >= SDL_max(timers_size, 1); i--) {
+      timers[i] = (TIMER_ENTRY){.next = timers_free};
+      timers_free = i;
+    }
+    timers_size = size;
+  }
+  const I i = timers_free;
+  timers_free = timers[i].next;
+
+  // The first call is a whole period from now
+  const U32 due = (U32)timer + (U32)period;
+  const I slot = (I)(due & (TIMER_WHEEL_SIZE - 1));
+  const I gen = (timers[i].gen + 1) & TIMER_GEN_MASK;
+  timers[i] = (TIMER_ENTRY){.func = func, .period = period, .due = due, .next = timer_wheel[slot], .gen = gen};
+  timer_wheel[slot] = i;
+  return i | gen << TIMER_ENTRY_BITS;
+}
 
-//===================================================TIMER_ST=====================================================
-V TIMER_SET(I period, V (*func)(V)) { SDL_LogInfo(0, "TIMER_SET not implemented"); }
+//==================================================VIEW_PRINT====================================================
+V VIEW_PRINT(I top, I bottom) {
+  if (top < 0 || bottom >= screen_height || top > bottom) {
+    SDL_LogError(0, "VIEW_PRINT: Invalid rows %d to %d", top, bottom);
+    return;
+  }
+  view_top = top;
+  view_bottom = bottom;
+  LOCATE(0, top);
+}
 
 //=====================================================WAIT=======================================================
 V WAIT(I dur) {
@@ -711,10 +2632,79 @@ V WAIT(I dur) {
     UPDATE();
 }
 
+//=====================================================WGET=======================================================
+CELL WGET(I x, I y) {
+  if (x < 0 || x >= world_w || y < 0 || y >= world_h)
+    return world_fill;
+  return *world_at(x, y);
+}
+
+//=====================================================WIDTH======================================================
+V WIDTH(I cols, I rows) {
+  if (cols < 1 || cols > SCREEN_MAX_WIDTH || rows < 1 || rows > SCREEN_MAX_HEIGHT) {
+    SDL_LogError(0, "WIDTH: Invalid mode %dx%d", cols, rows);
+    return;
+  }
+  if (!set_mode(cols, rows)) {
+    SDL_LogError(0, "WIDTH Failed to switch to %dx%d: %s", cols, rows, SDL_GetError());
+    return;
+  }
+  CLS(' ');
+}
+
+//=====================================================WORLD======================================================
+V WORLD(I w, I h, CELL fill) {
+  if (w < 0 || h < 0 || w > 0xFFFF || h > 0xFFFF) {
+    SDL_LogError(0, "WORLD: Invalid size %dx%d", w, h);
+    return;
+  }
+
+  // Whole tiles are allocated, the cells past the edge of the world are never shown
+  const I tiles_w = (w + WORLD_TILE_MASK) >> WORLD_TILE_BITS;
+  const I tiles_h = (h + WORLD_TILE_MASK) >> WORLD_TILE_BITS;
+  CELL *cells = NULL;
+  if (w && h) {
+    cells = SDL_malloc((Z)tiles_w * tiles_h * WORLD_TILE * WORLD_TILE * sizeof(CELL));
+    if (!cells) {
+      SDL_LogError(0, "WORLD: Out of memory for %dx%d", w, h);
+      return;
+    }
+    for (Z i = 0; i < (Z)tiles_w * tiles_h * WORLD_TILE * WORLD_TILE; i++)
+      cells[i] = fill;
+  }
+
+  SDL_free(world);
+  world = cells;
+  world_tiles = tiles_w;
+  world_w = cells ? w : 0;
+  world_h = cells ? h : 0;
+  world_fill = fill;
+  camera_x = 0;
+  camera_y = 0;
+  camera_page = -1;
+}
+
+//=====================================================WSET=======================================================
+V WSET(I x, I y, CELL c) {
+  if (x < 0 || x >= world_w || y < 0 || y >= world_h)
+    return;
+  *world_at(x, y) = c;
+
+  // The page the camera drew keeps showing the world, whether or not it's still the active page
+  const I sx = x - camera_x, sy = y - camera_y;
+  if (camera_page >= 0 && sx >= 0 && sx < screen_width && sy >= 0 && sy < screen_height) {
+    const I py = rows_at(camera_page)[sy];
+    row_at(page_at(camera_page), py)[sx] = c;
+    if (camera_page == visible_page)
+      set_verts(sx, py, c);
+    profile_sets++;
+  }
+}
+
 //=====================================================DATA=======================================================
 static const I letter_to_note[256] = {
-    ['c'] = 1, ['C'] = 1, ['d'] = 3, ['D'] = 3,  ['e'] = 5,  ['E'] = 5,  ['f'] = 6,
-    ['F'] = 6, ['g'] = 8, ['G'] = 8, ['a'] = 10, ['A'] = 10, ['b'] = 12, ['B'] = 12,
+    ['c'] = 0, ['C'] = 0, ['d'] = 2, ['D'] = 2, ['e'] = 4, ['E'] = 4, ['f'] = 5,
+    ['F'] = 5, ['g'] = 7, ['G'] = 7, ['a'] = 9, ['A'] = 9, ['b'] = 11, ['B'] = 11,
 };
 
 static const I note_frequency[8][12] = {
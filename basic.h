@@ -11,10 +11,13 @@
 #define WINDOW_WIDTH 800
 #define WINDOW_HEIGHT 600
 
-#define SCREEN_WIDTH 80
-#define SCREEN_HEIGHT 25
+#define SCREEN_WIDTH 80      // The text mode at START, WIDTH switches to others
+#define SCREEN_HEIGHT 25     //
+#define SCREEN_MAX_WIDTH 132 // The largest text mode WIDTH allows
+#define SCREEN_MAX_HEIGHT 60 //
 #define FONT_WIDTH 9
 #define FONT_HEIGHT 16
+#define SCREEN_PAGES 8
 
 #define TYPOMATIC_DELAY 20
 #define TYPOMATIC_INTERVAL 5
@@ -39,6 +42,48 @@ enum {
   WHITE
 };
 
+enum {               // Modes for HEADLESS. BASIC_HEADLESS=0, 1 or 2 in the environment overrides the mode.
+  HEADLESS_OFF,      // Open a window as usual
+  HEADLESS_RENDER,   // No window, the screen is rendered into a CPU framebuffer as fast as possible
+  HEADLESS_NORENDER, // No window, the screen is never rendered. Only the screen cells and input are updated.
+};
+
+enum {             // Modes for RENDER_MODE. BASIC_RENDER=0 or 1 in the environment sets the mode at START.
+  RENDER_GEOMETRY, // Draw the cells on the GPU with SDL_RenderGeometry
+  RENDER_SOFTWARE, // Rasterize the cells on the CPU and upload them to a streaming texture
+};
+
+enum {            // Modes for SCALE. BASIC_SCALE=0, 1 or 2 in the environment sets the mode at START.
+  SCALE_FILTERED, // Filter the screen to fill the window at 4:3, in one pass
+  SCALE_INTEGER,  // The largest whole multiple of the screen's pixels that fits the window, sharp
+  SCALE_SMOOTH,   // Scale the screen up 3x sharp, then filter that to fill the window at 4:3
+};
+
+enum {        // Styles for BOX, drawn with the CP437 line glyphs
+  BOX_SINGLE, // Single lines
+  BOX_DOUBLE, // Double lines
+};
+
+enum {                                                // Flags for PROFILE
+  PROFILE_OFF = 0,                                    // Stop profiling
+  PROFILE_ON = 1,                                     // Time every phase of UPDATE
+  PROFILE_OVERLAY_BIT = 2,                            // Show the p99s in the bottom row of the screen
+  PROFILE_OVERLAY = PROFILE_ON | PROFILE_OVERLAY_BIT, // Time every phase of UPDATE and show the p99s
+};
+
+enum {              // Phases of a frame for PROFILE_GET, in the order they happen
+  PROFILE_PROGRAM,  // The program itself, from the end of one UPDATE to the start of the next
+  PROFILE_KEYBOARD, // Pumping events and taking the keyboard snapshot
+  PROFILE_EVENTS,   // Handling the window and key events
+  PROFILE_TIMERS,   // TIMER_SET callbacks
+  PROFILE_RENDER,   // Drawing the dirty cells, with SDL_RenderGeometry or the software renderer
+  PROFILE_COPY,     // Copying the screen texture to the window
+  PROFILE_PRESENT,  // SDL_RenderPresent
+  PROFILE_WAIT,     // Waiting for the next frame
+  PROFILE_SETS,     // Not a phase, the number of SET calls in the frame
+  PROFILE_PHASES
+};
+
 //=====================================================TYPES======================================================
 typedef int I;         // Short names for common types
 typedef Sint8 I8;      //
@@ -62,42 +107,105 @@ typedef struct { // A CELL is a character on the screen, including it background
   C glyph;       //
 } CELL;          //
 
-typedef SDL_Keycode KEY;
+typedef struct { // A PCG32 random number generator, give each simulation its own for an independent stream
+  U64 state;     //
+  U64 inc;       //
+} RNG;           //
+
+typedef SDL_Keycode KEY;   // A key by what it types, for ISKEY
+typedef SDL_Scancode SCAN; // A key by where it is on the keyboard, for ISSCAN. These skip a lookup.
+
+typedef struct { // Stats of a PROFILE phase over the latest frames, in milliseconds or SET calls
+  D last;        // The last frame
+  D p50;         //
+  D p99;         //
+  D max;         //
+} TIMING;        //
+
+typedef struct { // Health of the audio thread from AUDIO_STATS, since START or AUDIO_OFFLINE
+  I callbacks;   // Buffers filled
+  D avg_ms;      // Average and slowest time to fill a buffer, in milliseconds
+  D max_ms;      //
+  I late;        // Buffers that came close to not being ready in time to play
+  I dropped;     // Messages from the audio thread lost because UPDATE wasn't called often enough to log them
+} AUDIO_HEALTH;  //
 
 //===================================================FUNCTIONS====================================================
 V START(const C *window_title); // START must be called at the beginnig of all programs
 I UPDATE();                     // Update must be called at the beginning of every frame
 V END();                        // END must be called at the end of the program
 
+I AUDIO_BUSY();                                        // Is offline audio still playing anything?
+V AUDIO_OFFLINE(I freq);                               // Render audio at freq Hz with AUDIO_RENDER instead
+V AUDIO_RENDER(I len, I16 buf[len]);                   // Render the next len samples of offline audio
+AUDIO_HEALTH AUDIO_STATS();                            // Get the health of the audio thread
+I AUDIO_WAV(const C *path, I len, const I16 buf[len]); // Write len samples to a mono 16-bit WAV file
+
+V BOX(I x, I y, I w, I h, I style);                   // Draw a box's lines in the cursor color with a BOX_ style
+V FILL(I x, I y, I w, I h, CELL c);                   // Set every cell of the w by h rectangle from x,y to c
+V GETRECT(I x, I y, I w, I h, CELL buf[w * h]);       // Copy the rectangle into buf row by row, like QBasic GET
+V PUTRECT(I x, I y, I w, I h, const CELL buf[w * h]); // Copy buf to the rectangle, like QBasic PUT
+V SCROLL(I x, I y, I w, I h, I n);                    // Scroll the rectangle up n rows, or down if n is negative
+
 V BEEP();                            // Produce a beep on the speaker
+V CAMERA(I x, I y);                  // Show the WORLD on the active page with world cell x,y at the top left
 V CLS(I c);                          // Clear the screen using the cursor color and provided character
 V COLOR(I fg, I bg);                 // Set the color that PRINT and CLS will use
-CELL GET(I x, I y);                  // Get screen cell at x,y
+CELL GET(I x, I y);                  // Get cell at x,y on the active page, or a 0 cell off the screen
+V HEADLESS(I mode);                  // Run without a window using a HEADLESS_ mode, must be called before START
 KEY INKEY();                         // Reads a keypress from the keyboard, or returns if none pressed
 V INPUT(I size, C buf[size]);        // Reads input from the keyboard
 I ISKEY(KEY k);                      // Is KEY pressed?
 I ISKEYJUST(KEY k);                  // Was KEY just pressed this frame?
 I ISNOKEY(KEY k);                    // Is KEY released?
 I ISNOKEYJUST(KEY k);                // Was KEY just released this frame?
+I ISNOSCAN(SCAN s);                  // Is SCAN released?
+I ISNOSCANJUST(SCAN s);              // Was SCAN just released this frame?
+I ISSCAN(SCAN s);                    // Is SCAN pressed?
+I ISSCANJUST(SCAN s);                // Was SCAN just pressed this frame, or repeated by typematic?
 V LOCATE(I x, I y);                  // Positions the cursor on the screen
 V LOCATEREL(I x, I y);               // Move the cursor relative to current position
-V PLAY(const C *song);               // Play a song, returns immediately
+V PCOPY(I src, I dst);               // Copy page src to page dst
+I PLAY(const C *song);               // Play a song, returns immediately, 0 if it doesn't parse or can't be queued
 V PLAY_OFF();                        // Disables music
 V PLAY_ON();                         // Enabled music
 V PLAY_START();                      // Starts music
 V PLAY_STOP();                       // Stops music
 V POS(I *x, I *y);                   // Get the position of the cursor
 V PRINT(const C *format, ...);       // Prints string to the screen at POS
+V PRINTN(const C *text, I n);        // Prints up to n characters of text without formatting
 V PRINTRAW(const C *format, ...);    // Prints string to the screen, ignoring any control characters
+V PRINTRAWN(const C *text, I n);     // Prints up to n characters of text, ignoring any control characters
+V PRINTS(const C *text);             // Prints text without formatting, the fastest way to print a string
+V PROFILE(I flags, CC *csv);         // Profile UPDATE with PROFILE_ flags, END writes every frame to csv
+TIMING PROFILE_GET(I phase);         // Get the stats of a PROFILE_ phase
 I RANDOM(I min, I max);              // Return a random number between min and max, inclusive
 V RANDOMIZE(I n);                    // Initialize the random number generator
-V SET(I x, I y, CELL c);             // Set cell at x,y
+V RECORD(CC *path);                  // Record input to a file before START, or set BASIC_RECORD=path
+I REDRAWN();                         // Number of cells redrawn by the last UPDATE, 0 if the screen was unchanged
+V RENDER_MODE(I mode);               // Select how the screen is drawn using a RENDER_ mode
+V REPLAY(CC *path);                  // Replay RECORD's input unthrottled from START, or set BASIC_REPLAY
+V RNG_FILL(RNG *r, I n, U32 out[n]); // Fill out with n random numbers from r, faster than n calls to RNG_NEXT
+U32 RNG_NEXT(RNG *r);                // Get a random number from r
+I RNG_RANGE(RNG *r, I min, I max);   // Get a random number between min and max from r, inclusive and unbiased
+V RNG_SEED(RNG *r, U64 seed, I id);  // Seed r, generators with different ids give independent streams
+V SCALE(I mode);                     // Select how the screen is scaled to the window using a SCALE_ mode
+V SCREEN(I apage, I vpage);          // Set the active page that is drawn to and the visible page that is shown
+U32 SCREEN_HASH();                   // Hash of every cell on the visible page
+V SCREEN_SIZE(I *cols, I *rows);     // Get the size of the text mode
+V SET(I x, I y, CELL c);             // Set cell at x,y on the active page, nothing happens off the screen
 V SET_CHAR(I x, I y, C c);           // Set cell at x,y with char c, but preserve color
 V SOUND(I freq, D dur);              // Play a sound at frequency for duration frames
 I STICK(I param);                    // Returns the coordinates of a joystick
-V TIMER();                           // Get the current value of the timer, which increments every frame
-V TIMER_OFF();                       // Turn timers off
-V TIMER_ON();                        // Turns timers on
+I TIMER();                           // Get the current value of the timer, which increments every frame
+V TIMER_KILL(I id);                  // Delete the timer TIMER_SET returned
+V TIMER_OFF();                       // Turn timers off, they keep counting but their callbacks aren't called
+V TIMER_ON();                        // Turns timers on, they start off
 V TIMER_RESET();                     // Deletes all active timers
-V TIMER_SET(I period, V (*func)(V)); // Set a timer callback
+I TIMER_SET(I period, V (*func)(V)); // Call func every period frames, returns an id for TIMER_KILL or 0
+V VIEW_PRINT(I top, I bottom);       // Set the rows PRINT scrolls, from 0 to the bottom row for all
 V WAIT(I dur);                       // Wait for dur frames
+CELL WGET(I x, I y);                 // Get the WORLD cell at x,y, or the fill cell outside the world
+V WIDTH(I cols, I rows);             // Switch to a cols by rows text mode such as 40x25 or 80x50 and clear it
+V WORLD(I w, I h, CELL fill);        // Create a w by h world of fill cells for CAMERA to look at, 0 by 0 frees it
+V WSET(I x, I y, CELL c);            // Set the WORLD cell at x,y, and the screen if the camera shows it
@@ -0,0 +1,220 @@
+//==================================================BASIC_BENCH===================================================
+// Benchmarks of the library. They run headless on SDL's software renderer, so they time the library rather than
+// the display, and print each result on a line of its own as a name followed by key=value pairs, for tracking
+// over time. The frames argument scales every benchmark. Usage:
+//   basic_bench [frames]
+#include "basic.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//====================================================seconds=====================================================
+static D seconds(U64 ticks) { return (D)ticks / (D)SDL_GetPerformanceFrequency(); }
+
+//======================================================set=======================================================
+// SET every cell of the screen, without UPDATE, on the visible page where the verts follow the cells and on a
+// hidden page where they don't
+static V set(I frames) {
+  static CC *pages[] = {"visible", "hidden"};
+  WIDTH(80, 25);
+  for (I p = 0; p < 2; p++) {
+    SCREEN(p, 0);
+    const U64 start = SDL_GetPerformanceCounter();
+    for (I f = 0; f < frames; f++)
+      for (I y = 0; y < 25; y++)
+        for (I x = 0; x < 80; x++)
+          SET(x, y, (CELL){.fg = (x + f) & 0xF, .bg = (y + f) & 0x7, .glyph = (C)(x + y + f)});
+    const D s = seconds(SDL_GetPerformanceCounter() - start);
+    printf("set page=%s calls=%d ns_per_call=%.2f\n", pages[p], frames * 2000, s * 1e9 / (frames * 2000.0));
+  }
+  SCREEN(0, 0);
+  UPDATE();
+}
+
+//======================================================cls=======================================================
+static V cls(I frames) {
+  WIDTH(80, 25);
+  const U64 start = SDL_GetPerformanceCounter();
+  for (I f = 0; f < frames; f++)
+    CLS('A' + f % 26);
+  const D s = seconds(SDL_GetPerformanceCounter() - start);
+  printf("cls calls=%d us_per_call=%.3f\n", frames, s * 1e6 / frames);
+  UPDATE();
+}
+
+//=====================================================print======================================================
+// Print lines that scroll the screen, formatted with PRINT and as they are with PRINTS
+static V print(I frames) {
+  static CC line[] = "The quick brown fox jumps over the lazy dog, 0123456789\n";
+  static CC *calls[] = {"PRINT", "PRINTS"};
+  WIDTH(80, 25);
+  for (I c = 0; c < 2; c++) {
+    const I lines = frames * 25;
+    const U64 start = SDL_GetPerformanceCounter();
+    for (I i = 0; i < lines; i++) {
+      if (c)
+        PRINTS(line);
+      else
+        PRINT("%6d %s", i, line);
+    }
+    const D s = seconds(SDL_GetPerformanceCounter() - start);
+    printf("print call=%s lines=%d us_per_line=%.3f\n", calls[c], lines, s * 1e6 / lines);
+    UPDATE();
+  }
+}
+
+//====================================================panels======================================================
+// Redraw a UI of overlapping windows every frame, a FILL and a BOX for each, then one window's worth of GETRECT
+// and PUTRECT
+static V panels(I frames) {
+  static CELL saved[30 * 10];
+  WIDTH(80, 25);
+  const U64 start = SDL_GetPerformanceCounter();
+  for (I f = 0; f < frames; f++) {
+    for (I i = 0; i < 6; i++) {
+      COLOR(WHITE, (i + f) & 0x7);
+      FILL(i * 9, i * 2, 30, 10, (CELL){.fg = WHITE, .bg = (i + f) & 0x7, .glyph = ' '});
+      BOX(i * 9, i * 2, 30, 10, i & 1 ? BOX_DOUBLE : BOX_SINGLE);
+    }
+    GETRECT(0, 0, 30, 10, saved);
+    PUTRECT(50, 15, 30, 10, saved);
+  }
+  const D s = seconds(SDL_GetPerformanceCounter() - start);
+  printf("panels frames=%d us_per_frame=%.3f\n", frames, s * 1e6 / frames);
+  UPDATE();
+}
+
+//====================================================update======================================================
+// UPDATE with nothing changed, one row changed and the whole screen changed
+static V update(I frames) {
+  static CC *changes[] = {"none", "row", "all"};
+  WIDTH(80, 25);
+  RENDER_MODE(RENDER_GEOMETRY);
+  UPDATE();
+  for (I c = 0; c < 3; c++) {
+    U64 ticks = 0;
+    for (I f = 0; f < frames; f++) {
+      const CELL cell = {.fg = f & 0xF, .bg = BLACK, .glyph = (C)('A' + f % 26)};
+      for (I y = 0; y < (c == 2 ? 25 : c); y++)
+        for (I x = 0; x < 80; x++)
+          SET(x, y, cell);
+      const U64 start = SDL_GetPerformanceCounter();
+      UPDATE();
+      ticks += SDL_GetPerformanceCounter() - start;
+    }
+    printf("update changed=%s frames=%d frame_ms=%.4f\n", changes[c], frames, seconds(ticks) * 1000 / frames);
+  }
+}
+
+//=====================================================modes======================================================
+// Change every cell of every text mode on every frame, the worst case for UPDATE, with both RENDER_ modes. A mode
+// holds 60 fps while set_ms + update_ms stays under 16.7.
+static V modes(I frames) {
+  static const I sizes[][2] = {{40, 25}, {80, 25}, {80, 43}, {80, 50}, {132, 60}};
+  static CC *renders[] = {"geometry", "software"};
+
+  for (I m = 0; m < (I)SDL_arraysize(sizes); m++) {
+    for (I r = RENDER_GEOMETRY; r <= RENDER_SOFTWARE; r++) {
+      const I cols = sizes[m][0], rows = sizes[m][1];
+      WIDTH(cols, rows);
+      RENDER_MODE(r);
+      UPDATE();
+
+      U64 set_ticks = 0, update_ticks = 0;
+      for (I f = 0; f < frames; f++) {
+        const U64 start = SDL_GetPerformanceCounter();
+        for (I y = 0; y < rows; y++)
+          for (I x = 0; x < cols; x++)
+            SET(x, y, (CELL){.fg = (x + f) & 0xF, .bg = (y + f) & 0x7, .glyph = (C)(x + y + f)});
+        const U64 set = SDL_GetPerformanceCounter();
+        UPDATE();
+        set_ticks += set - start;
+        update_ticks += SDL_GetPerformanceCounter() - set;
+      }
+
+      const D set_ms = seconds(set_ticks) * 1000 / frames;
+      const D update_ms = seconds(update_ticks) * 1000 / frames;
+      printf("modes cols=%d rows=%d render=%s frames=%d set_ms=%.3f update_ms=%.3f fps=%.0f\n", cols, rows,
+             renders[r], frames, set_ms, update_ms, 1000 / (set_ms + update_ms));
+    }
+  }
+}
+
+//=====================================================world======================================================
+// Pan the camera over a 1024x1024 world, down a row a frame and then right a column a frame
+static V world(I frames) {
+  RNG rng;
+  RNG_SEED(&rng, 1, 0);
+  WIDTH(80, 25);
+  RENDER_MODE(RENDER_GEOMETRY);
+  WORLD(1024, 1024, (CELL){.fg = WHITE, .bg = BLACK, .glyph = ' '});
+  for (I y = 0; y < 1024; y++) {
+    for (I x = 0; x < 1024; x++) {
+      const U32 r = RNG_NEXT(&rng);
+      WSET(x, y, (CELL){.fg = r & 0xF, .bg = BLACK, .glyph = r >> 8 & 0x7 ? '.' : '#'});
+    }
+  }
+
+  static CC *moves[] = {"down", "right"};
+  for (I m = 0; m < 2; m++) {
+    CAMERA(0, 0);
+    UPDATE();
+    U64 ticks = 0, cells = 0;
+    for (I f = 1; f <= frames; f++) {
+      const U64 start = SDL_GetPerformanceCounter();
+      CAMERA(m ? f % 900 : 0, m ? 0 : f % 900);
+      UPDATE();
+      ticks += SDL_GetPerformanceCounter() - start;
+      cells += REDRAWN();
+    }
+    printf("world move=%s frames=%d frame_ms=%.3f cells=%.0f\n", moves[m], frames,
+           seconds(ticks) * 1000 / frames, (D)cells / frames);
+  }
+  WORLD(0, 0, (CELL){0});
+}
+
+//=====================================================audio======================================================
+// Synthesize music offline in the device's 512 sample buffers, with the music voice and then SOUND effects on
+// every other voice as well. A buffer is due every 11.6 ms at 44100 Hz. AUDIO_STATS gives the slowest buffer.
+static V audio(I frames) {
+  static CC song[] = "MB T200 L16 O3 CDEFGAB>CDEFGAB>CDEFGAB<< L8 CEG>C P8 ML L4 O2 ABC+D MS L16 EFGABAGFE";
+  static CC *voices[] = {"music", "mixed"};
+  I16 buf[512];
+  for (I v = 0; v < 2; v++) {
+    AUDIO_OFFLINE(44100);
+    I samples = 0;
+    U64 ticks = 0;
+    for (I f = 0; f < frames / 10 + 1; f++) {
+      PLAY(song);
+      for (I i = 0; v && i < 7; i++)
+        SOUND(200 + i * 150, 3.0);
+      while (AUDIO_BUSY()) {
+        const U64 start = SDL_GetPerformanceCounter();
+        AUDIO_RENDER(512, buf);
+        ticks += SDL_GetPerformanceCounter() - start;
+        samples += 512;
+      }
+    }
+    const D s = seconds(ticks);
+    const AUDIO_HEALTH h = AUDIO_STATS();
+    printf("audio voices=%s samples=%d us_per_buffer=%.3f max_us_per_buffer=%.3f realtime=%.0f\n", voices[v],
+           samples, s * 1e6 * 512 / samples, h.max_ms * 1000, samples / 44100.0 / s);
+  }
+}
+
+//=====================================================main=======================================================
+int main(int argc, char *argv[]) {
+  const I frames = argc > 1 ? SDL_max(atoi(argv[1]), 1) : 300;
+
+  HEADLESS(HEADLESS_RENDER);
+  START("basic_bench");
+  set(frames);
+  cls(frames);
+  print(frames);
+  panels(frames);
+  update(frames);
+  modes(frames);
+  world(frames);
+  audio(frames);
+  END();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+//===================================================BASIC_TEST===================================================
+// Regression tests of the library. They run headless without rendering, print each failure on a line of its own
+// and exit with failure if there were any. Usage:
+//   basic_test
+#include "basic.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static I failures;
+
+//=====================================================check======================================================
+static V check(I ok, CC *test, CC *what) {
+  if (!ok) {
+    printf("FAIL %s: %s\n", test, what);
+    failures++;
+  }
+}
+
+//==================================================timer_kill====================================================
+// Killing a timer that's already gone mustn't kill the newer timer that took its place
+static I ticks;
+static V tick() { ticks++; }
+
+static V timer_kill() {
+  TIMER_ON();
+  const I old = TIMER_SET(1, tick);
+  TIMER_KILL(old);
+  UPDATE();
+  const I id = TIMER_SET(1, tick);
+  TIMER_KILL(old);
+  ticks = 0;
+  UPDATE();
+  check(ticks == 1, "timer_kill", "a stale id killed a newer timer");
+  TIMER_KILL(id);
+  TIMER_OFF();
+}
+
+//===================================================profile_on===================================================
+// PROFILE_ON only times UPDATE, it mustn't draw the overlay over the bottom row
+static V profile_on() {
+  UPDATE();
+  PROFILE(PROFILE_ON, NULL);
+  for (I f = 0; f < 3; f++) {
+    UPDATE();
+    check(REDRAWN() == 0, "profile_on", "an idle screen was redrawn");
+  }
+  PROFILE(PROFILE_OFF, NULL);
+}
+
+//=================================================profile_overlay================================================
+// PROFILE_OVERLAY only redraws the bottom row when its text changes or something has been drawn over it
+static V profile_overlay() {
+  UPDATE();
+  PROFILE(PROFILE_OVERLAY, NULL);
+  I frames = 0;
+  for (I f = 0; f < 60; f++) {
+    UPDATE();
+    frames += REDRAWN() > 0;
+  }
+  check(frames <= 3, "profile_overlay", "an idle screen was redrawn between refreshes");
+
+  SET(0, 24, (CELL){.fg = WHITE, .bg = BLACK, .glyph = 'X'});
+  UPDATE();
+  check(REDRAWN() > 0 && GET(0, 24).glyph == 'X', "profile_overlay", "a SET under the overlay wasn't covered");
+  PROFILE(PROFILE_OFF, NULL);
+  UPDATE();
+  check(REDRAWN() == 80, "profile_overlay", "turning the overlay off didn't put the bottom row back");
+}
+
+//===================================================view_print===================================================
+// Text LOCATEd below the VIEW_PRINT region is a status line, only text that runs off the region scrolls it
+static V view_print() {
+  VIEW_PRINT(0, 20);
+  LOCATE(0, 20);
+  PRINTS("PANE");
+  LOCATE(0, 23);
+  PRINTS("STATUS");
+  check(GET(0, 23).glyph == 'S', "view_print", "the status line wasn't written where it was LOCATEd");
+  check(GET(0, 20).glyph == 'P', "view_print", "the status line scrolled the region");
+
+  LOCATE(0, 20);
+  PRINTS("A\nB");
+  check(GET(0, 19).glyph == 'A' && GET(0, 20).glyph == 'B', "view_print", "a new line didn't scroll the region");
+  check(GET(0, 23).glyph == 'S', "view_print", "scrolling the region moved the status line");
+  VIEW_PRINT(0, 24);
+}
+
+//=====================================================width======================================================
+// SET and GET past the edges of a text mode smaller than SCREEN_WIDTH by SCREEN_HEIGHT stay off the screen
+static V width() {
+  WIDTH(40, 25);
+  SET(SCREEN_WIDTH - 1, 0, (CELL){.fg = WHITE, .bg = BLACK, .glyph = 'X'});
+  SET(0, SCREEN_HEIGHT, (CELL){.fg = WHITE, .bg = BLACK, .glyph = 'X'});
+  check(GET(39, 1).glyph == ' ', "width", "SET past the right edge wrapped onto the next row");
+  check(GET(SCREEN_WIDTH - 1, 0).glyph == 0, "width", "GET past the right edge read another cell");
+  WIDTH(80, 25);
+}
+
+//=====================================================camera=====================================================
+// Anything drawn over the camera's page mustn't scroll with the world when the camera moves, and mustn't stop WSET
+// showing on it
+static V camera() {
+  static CC *writers[] = {"SET", "PRINT", "FILL"};
+  WORLD(100, 100, (CELL){.fg = LIGHT_GRAY, .bg = BLACK, .glyph = '.'});
+  for (I w = 0; w < (I)SDL_arraysize(writers); w++) {
+    CAMERA(0, 0);
+    if (w == 0) {
+      SET(5, 5, (CELL){.fg = WHITE, .bg = BLACK, .glyph = '@'});
+    } else if (w == 1) {
+      LOCATE(5, 5);
+      PRINT("@");
+    } else {
+      FILL(5, 5, 1, 1, (CELL){.fg = WHITE, .bg = BLACK, .glyph = '@'});
+    }
+    CAMERA(0, 1);
+    check(GET(5, 4).glyph == '.', "camera", writers[w]);
+  }
+
+  // A HUD drawn over the WORLD doesn't stop WSET showing on the screen
+  CAMERA(0, 0);
+  LOCATE(0, 0);
+  PRINTS("HP");
+  WSET(5, 5, (CELL){.fg = WHITE, .bg = BLACK, .glyph = '@'});
+  check(GET(5, 5).glyph == '@', "camera", "WSET after a HUD");
+  WORLD(0, 0, (CELL){0});
+}
+
+//=====================================================main=======================================================
+int main(int argc, char *argv[]) {
+  (V) argc;
+  (V) argv;
+
+  HEADLESS(HEADLESS_NORENDER);
+  START("basic_test");
+  timer_kill();
+  profile_on();
+  profile_overlay();
+  view_print();
+  width();
+  camera();
+  END();
+  printf("%d failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+//====================================================PLAYWAV=====================================================
+// Renders a PLAY string offline as fast as possible, then prints a hash of the samples and the synthesis speed.
+// The hash makes a regression test of the MML engine, the speed a benchmark. A song that doesn't parse or renders
+// no samples fails. Usage:
+//   playwav "T120 L8 CDEFGAB" [out.wav] [freq]
+#include "basic.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//=====================================================main=======================================================
+int main(int argc, char *argv[]) {
+  const I freq = argc > 3 ? atoi(argv[3]) : 44100;
+  if (argc < 2 || freq <= 0) {
+    fprintf(stderr, "usage: %s song [out.wav] [freq]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  AUDIO_OFFLINE(freq);
+  if (!PLAY(argv[1])) {
+    fprintf(stderr, "%s doesn't parse\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  // Render in blocks until the song is over, timing only the synthesis
+  I len = 0, size = 0;
+  I16 *samples = NULL;
+  U64 ticks = 0;
+  while (AUDIO_BUSY()) {
+    if (len + 4096 > size) {
+      size = SDL_max(size * 2, 65536);
+      samples = SDL_realloc(samples, size * sizeof(*samples));
+      if (!samples) {
+        fprintf(stderr, "out of memory\n");
+        return EXIT_FAILURE;
+      }
+    }
+    const U64 start = SDL_GetPerformanceCounter();
+    AUDIO_RENDER(4096, &samples[len]);
+    ticks += SDL_GetPerformanceCounter() - start;
+    len += 4096;
+  }
+
+  // FNV-1a over the little endian bytes of the samples
+  U32 hash = 2166136261u;
+  for (I i = 0; i < len; i++) {
+    hash = (hash ^ (U8)samples[i]) * 16777619u;
+    hash = (hash ^ (U8)((U16)samples[i] >> 8)) * 16777619u;
+  }
+
+  if (!len) {
+    fprintf(stderr, "%s renders no samples\n", argv[1]);
+    SDL_free(samples);
+    return EXIT_FAILURE;
+  }
+
+  const D seconds = (D)ticks / (D)SDL_GetPerformanceFrequency();
+  printf("hash %08x samples %d rate %.0f samples/s\n", hash, len, seconds > 0 ? len / seconds : 0.0);
+
+  I ok = 1;
+  if (argc > 2)
+    ok = AUDIO_WAV(argv[2], len, samples);
+  SDL_free(samples);
+  END();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}